@@ -21,6 +21,7 @@
 #include <kpathsea/c-stat.h>
 #include <kpathsea/c-fopen.h>
 #include <kpathsea/c-pathch.h>
+#include <kpathsea/c-unistd.h>
 #include <kpathsea/db.h>
 #include <kpathsea/hash.h>
 #include <kpathsea/line.h>
@@ -62,6 +63,73 @@ static string db_names[] = {
 #define ALIAS_HASH_SIZE 1009
 #endif
 
+#if !defined(WIN32)
+#include <sys/mman.h>
+#endif
+
+/* A compiled ls-R.  `kpsewhich -compile-db' (run by mktexlsr) writes it
+   next to the ls-R, under the same name with DB_INDEX_SUFFIX appended,
+   and we map it instead of reading and hashing the text.  It is only
+   used while the ls-R it was built from has the same size and
+   modification time, and is still in the same directory.  All numbers
+   are unsigned ints in the byte order of the machine that wrote the
+   file; an index written on another architecture is ignored.  */
+
+#ifndef DB_INDEX_SUFFIX
+#define DB_INDEX_SUFFIX ".idx"
+#endif
+#define DB_INDEX_MAGIC "kpseidx1"
+#define DB_INDEX_BYTE_ORDER 0x01020304
+
+typedef struct
+{
+  char magic[8];                /* DB_INDEX_MAGIC, without the null */
+  unsigned byte_order;          /* DB_INDEX_BYTE_ORDER */
+  unsigned header_size;         /* sizeof (db_index_header) */
+  unsigned db_size[2];          /* size of the ls-R, low word first */
+  unsigned db_mtime[2];         /* and its modification time */
+  unsigned slot_count;          /* a power of two, more than key_count */
+  unsigned key_count;
+  unsigned entry_count;
+  unsigned dir_count;
+  unsigned string_size;         /* the ls-R's own directory comes first */
+} db_index_header;
+
+/* The header is followed by an open-addressed hash table (key number + 1,
+   or 0 for an empty slot), the keys, the directory number of each entry
+   (those of one key being consecutive and in ls-R order), the string
+   offset of each directory name, and the strings.  */
+
+typedef struct
+{
+  unsigned name;                /* string offset of the file name */
+  unsigned first;               /* its first entry */
+  unsigned count;               /* and the number of entries */
+} db_index_key;
+
+typedef struct
+{
+  const db_index_header *header;
+  size_t size;
+  const unsigned *slots;
+  const db_index_key *keys;
+  const unsigned *entries;
+  const unsigned *dirs;
+  const char *strings;
+} db_index_type;
+
+/* The databases in the order they are searched.  Each part is either a
+   compiled index or a table holding one or more consecutive ls-R's read
+   as text.  The text of the ls-R's after the last index goes into
+   kpse->db, which also gets the files made during the run and is not
+   counted among the parts; without any index there are no parts.  */
+
+struct kpse_db_part
+{
+  db_index_type *index;
+  hash_table_type *table;
+};
+
 
 /* If DIRNAME contains any element beginning with a `.' (that is more
    than just `./'), return true.  This is to allow ``hidden''
@@ -81,79 +149,115 @@ ignore_dir_p (const_string dirname)
   return false;
 }
 
-/* If no DB_FILENAME, return false (maybe they aren't using this feature).
-   Otherwise, add entries from DB_FILENAME to TABLE, and return true.  */
+/* The directory of the ls-R file DB_FILENAME, with the trailing /.  */
 
-static boolean
-db_build (kpathsea kpse, hash_table_type *table,  const_string db_filename)
+static string
+db_top_dir (const_string db_filename)
 {
-  string line;
-  unsigned dir_count = 0, file_count = 0, ignore_dir_count = 0;
   unsigned len = strlen (db_filename) - sizeof (DB_NAME) + 1; /* Keep the /. */
   string top_dir = (string)xmalloc (len + 1);
+
+  strncpy (top_dir, db_filename, len);
+  top_dir[len] = 0;
+
+  return top_dir;
+}
+
+/* Called by db_read for each file entry, in ls-R order.  NAME is only
+   valid during the call; DIR is shared among all the files of a
+   directory (and hence never freed).  */
+typedef void (*db_entry_fn) (void *closure, const_string name,
+                             const_string dir);
+
+/* Read the entries of the ls-R file DB_FILE, whose directory is TOP_DIR,
+   passing each to ADD.  Return the number of entries.  */
+
+static unsigned
+db_read (kpathsea kpse, FILE *db_file, const_string top_dir,
+         db_entry_fn add, void *closure,
+         unsigned *dir_count, unsigned *ignore_dir_count)
+{
+  string line;
+  unsigned len, file_count = 0;
   string cur_dir = NULL; /* First thing in ls-R might be a filename.  */
-  FILE *db_file = fopen (db_filename, FOPEN_R_MODE);
 #if defined(WIN32)
   string pp;
 #endif
 
-  strncpy (top_dir, db_filename, len);
-  top_dir[len] = 0;
-
-  if (db_file) {
-    while ((line = read_line (db_file)) != NULL) {
-      len = strlen (line);
+  while ((line = read_line (db_file)) != NULL) {
+    len = strlen (line);
 
 #if defined(WIN32)
-      for (pp = line; *pp; pp++) {
-        if (IS_KANJI(pp))
-          pp++;
-        else
-          *pp = TRANSFORM(*pp);
-      }
+    for (pp = line; *pp; pp++) {
+      if (IS_KANJI(pp))
+        pp++;
+      else
+        *pp = TRANSFORM(*pp);
+    }
 #endif
 
-      /* A line like `/foo:' = new dir foo.  Allow both absolute (/...)
-         and explicitly relative (./...) names here.  It's a kludge to
-         pass in the directory name with the trailing : still attached,
-         but it doesn't actually hurt.  */
-      if (len > 0 && line[len - 1] == ':'
-          && kpathsea_absolute_p (kpse, line, true)) {
-        /* New directory line.  */
-        if (!ignore_dir_p (line)) {
-          /* If they gave a relative name, prepend full directory name now.  */
-          line[len - 1] = DIR_SEP;
-          /* Skip over leading `./', it confuses `match' and is just a
-             waste of space, anyway.  This will lose on `../', but `match'
-             won't work there, either, so it doesn't matter.  */
-          cur_dir = *line == '.' ? concat (top_dir, line + 2) : xstrdup (line);
-          dir_count++;
-        } else {
-          cur_dir = NULL;
-          ignore_dir_count++;
-        }
+    /* A line like `/foo:' = new dir foo.  Allow both absolute (/...)
+       and explicitly relative (./...) names here.  It's a kludge to
+       pass in the directory name with the trailing : still attached,
+       but it doesn't actually hurt.  */
+    if (len > 0 && line[len - 1] == ':'
+        && kpathsea_absolute_p (kpse, line, true)) {
+      /* New directory line.  */
+      if (!ignore_dir_p (line)) {
+        /* If they gave a relative name, prepend full directory name now.  */
+        line[len - 1] = DIR_SEP;
+        /* Skip over leading `./', it confuses `match' and is just a
+           waste of space, anyway.  This will lose on `../', but `match'
+           won't work there, either, so it doesn't matter.  */
+        cur_dir = *line == '.' ? concat (top_dir, line + 2) : xstrdup (line);
+        (*dir_count)++;
+      } else {
+        cur_dir = NULL;
+        (*ignore_dir_count)++;
+      }
 
-      /* Ignore blank, `.' and `..' lines.  */
-      } else if (*line != 0 && cur_dir   /* a file line? */
-                 && !(*line == '.'
-                      && (line[1] == 0 || (line[1] == '.' && line[2] == 0))))
-      {
-        /* Make a new hash table entry with a key of `line' and a data
-           of `cur_dir'.  An already-existing identical key is ok, since
-           a file named `foo' can be in more than one directory.  Share
-           `cur_dir' among all its files (and hence never free it).
-
-           Note that we assume that all names in the ls-R file have already
-           been case-smashed to lowercase where appropriate.
-        */
-        hash_insert_normalized (table, xstrdup (line), cur_dir);
-        file_count++;
-
-      } /* else ignore blank lines or top-level files
-           or files in ignored directories*/
+    /* Ignore blank, `.' and `..' lines.  */
+    } else if (*line != 0 && cur_dir   /* a file line? */
+               && !(*line == '.'
+                    && (line[1] == 0 || (line[1] == '.' && line[2] == 0))))
+    {
+      /* Note that we assume that all names in the ls-R file have already
+         been case-smashed to lowercase where appropriate.  */
+      (*add) (closure, line, cur_dir);
+      file_count++;
 
-      free (line);
-    }
+    } /* else ignore blank lines or top-level files
+         or files in ignored directories*/
+
+    free (line);
+  }
+
+  return file_count;
+}
+
+/* Make a new hash table entry with a key of NAME and a data of DIR.
+   An already-existing identical key is ok, since a file named `foo'
+   can be in more than one directory.  */
+
+static void
+db_insert_entry (void *table, const_string name, const_string dir)
+{
+  hash_insert_normalized ((hash_table_type *) table, xstrdup (name), dir);
+}
+
+/* If no DB_FILENAME, return false (maybe they aren't using this feature).
+   Otherwise, add entries from DB_FILENAME to TABLE, and return true.  */
+
+static boolean
+db_build (kpathsea kpse, hash_table_type *table,  const_string db_filename)
+{
+  unsigned dir_count = 0, file_count = 0, ignore_dir_count = 0;
+  string top_dir = db_top_dir (db_filename);
+  FILE *db_file = fopen (db_filename, FOPEN_R_MODE);
+
+  if (db_file) {
+    file_count = db_read (kpse, db_file, top_dir, db_insert_entry, table,
+                          &dir_count, &ignore_dir_count);
 
     xfclose (db_file, db_filename);
 
@@ -187,6 +291,390 @@ db_build (kpathsea kpse, hash_table_type *table,  const_string db_filename)
   return db_file != NULL;
 }
 
+/* The hash function for compiled indexes.  The keys stored are already
+   normalized, so this gives the same value for them either way.  */
+
+static unsigned
+db_index_hash (const_string key)
+{
+  unsigned n = 2166136261U;
+
+  while (*key != 0)
+#if defined(WIN32)
+    if (IS_KANJI(key)) {
+      n = (n ^ (unsigned char)*key++) * 16777619U;
+      n = (n ^ (unsigned char)*key++) * 16777619U;
+    } else
+#endif
+    n = (n ^ (unsigned char)TRANSFORM (*key++)) * 16777619U;
+
+  return n;
+}
+
+/* Split a size or time into the two words stored in the header.  */
+
+static void
+db_index_split (unsigned long long value, unsigned word[2])
+{
+  word[0] = (unsigned) (value & 0xffffffffU);
+  word[1] = (unsigned) (value >> 32);
+}
+
+/* Map the compiled index of DB_FILENAME, if there is one and it is
+   up to date; otherwise return NULL.  */
+
+static db_index_type *
+db_index_open (kpathsea kpse, const_string db_filename, const_string top_dir)
+{
+  string index_name = concat (db_filename, DB_INDEX_SUFFIX);
+  db_index_type *index = NULL;
+  const db_index_header *h;
+  struct stat db_stat, index_stat;
+  unsigned db_size[2], db_mtime[2];
+  size_t size, expected;
+  char *base = NULL;
+  FILE *f;
+
+  if (stat (db_filename, &db_stat) != 0
+      || (f = fopen (index_name, FOPEN_RBIN_MODE)) == NULL) {
+    free (index_name);
+    return NULL;
+  }
+
+  if (fstat (fileno (f), &index_stat) == 0
+      && index_stat.st_size >= (off_t) sizeof (db_index_header)) {
+    size = index_stat.st_size;
+#if defined(WIN32)
+    base = (char *) xmalloc (size);
+    if (fread (base, 1, size, f) != size) {
+      free (base);
+      base = NULL;
+    }
+#else
+    base = (char *) mmap (NULL, size, PROT_READ, MAP_SHARED, fileno (f), 0);
+    if (base == (char *) MAP_FAILED)
+      base = NULL;
+#endif
+  }
+  fclose (f);
+
+  if (base == NULL) {
+    free (index_name);
+    return NULL;
+  }
+
+  h = (const db_index_header *) base;
+  db_index_split (db_stat.st_size, db_size);
+  db_index_split (db_stat.st_mtime, db_mtime);
+  expected = sizeof (db_index_header)
+             + ((size_t) h->slot_count + h->entry_count + h->dir_count)
+               * sizeof (unsigned)
+             + (size_t) h->key_count * sizeof (db_index_key)
+             + h->string_size;
+
+  if (memcmp (h->magic, DB_INDEX_MAGIC, sizeof (h->magic)) == 0
+      && h->byte_order == DB_INDEX_BYTE_ORDER
+      && h->header_size == sizeof (db_index_header)
+      && h->db_size[0] == db_size[0] && h->db_size[1] == db_size[1]
+      && h->db_mtime[0] == db_mtime[0] && h->db_mtime[1] == db_mtime[1]
+      && h->slot_count > h->key_count
+      && (h->slot_count & (h->slot_count - 1)) == 0
+      && h->entry_count > 0
+      && h->slot_count < size && h->entry_count < size
+      && h->dir_count < size && h->key_count < size
+      && h->string_size > 0 && h->string_size < size
+      && expected == size
+      && base[size - 1] == 0
+      && STREQ (base + size - h->string_size, top_dir)) {
+    index = XTALLOC1 (db_index_type);
+    index->header = h;
+    index->size = size;
+    index->slots = (const unsigned *) (h + 1);
+    index->keys = (const db_index_key *) (index->slots + h->slot_count);
+    index->entries = (const unsigned *) (index->keys + h->key_count);
+    index->dirs = index->entries + h->entry_count;
+    index->strings = (const char *) (index->dirs + h->dir_count);
+  } else {
+#if defined(WIN32)
+    free (base);
+#else
+    munmap (base, size);
+#endif
+  }
+
+#ifdef KPSE_DEBUG
+  if (KPATHSEA_DEBUG_P (KPSE_DEBUG_HASH)) {
+    if (index)
+      DEBUGF3 ("%s: %u entries in %u directories.\n",
+               index_name, h->entry_count, h->dir_count);
+    else
+      DEBUGF1 ("db:init(): ignoring out of date or unusable %s.\n",
+               index_name);
+  }
+#endif
+
+  free (index_name);
+
+  return index;
+}
+
+/* Add the directories INDEX has for KEY to RET.  The file is only
+   checked as far as we read it, so look out for bad numbers.  */
+
+static void
+db_index_lookup (db_index_type *index, const_string key, cstr_list_type *ret)
+{
+  const db_index_header *h = index->header;
+  unsigned mask = h->slot_count - 1;
+  unsigned n = db_index_hash (key) & mask;
+  unsigned probes, s, e;
+
+  for (probes = 0; probes < h->slot_count; probes++) {
+    const db_index_key *k;
+
+    s = index->slots[n];
+    if (s == 0 || s > h->key_count)
+      return;
+
+    k = &index->keys[s - 1];
+    if (k->name < h->string_size
+        && FILESTRCASEEQ (index->strings + k->name, key)) {
+      if (k->first > h->entry_count || k->count > h->entry_count - k->first)
+        return;
+      for (e = k->first; e < k->first + k->count; e++) {
+        unsigned d = index->entries[e];
+        if (d < h->dir_count && index->dirs[d] < h->string_size)
+          cstr_list_add (ret, index->strings + index->dirs[d]);
+      }
+      return;
+    }
+
+    n = (n + 1) & mask;
+  }
+}
+
+/* Look up KEY in all the databases, and return NULL-terminated list of
+   all matching directories, in search order, like hash_lookup.  */
+
+static const_string *
+db_lookup (kpathsea kpse, const_string key)
+{
+  cstr_list_type ret;
+  const_string *dirs, *d;
+  unsigned p;
+
+  if (kpse->db_part_count == 0)
+    return hash_lookup (kpse->db, key);
+
+  ret = cstr_list_init ();
+  for (p = 0; p < kpse->db_part_count; p++) {
+    struct kpse_db_part *part = &kpse->db_parts[p];
+    if (part->index) {
+      db_index_lookup (part->index, key, &ret);
+    } else if ((dirs = hash_lookup (*part->table, key)) != NULL) {
+      for (d = dirs; *d; d++)
+        cstr_list_add (&ret, *d);
+      free ((void *) dirs);
+    }
+  }
+  if ((dirs = hash_lookup (kpse->db, key)) != NULL) {
+    for (d = dirs; *d; d++)
+      cstr_list_add (&ret, *d);
+    free ((void *) dirs);
+  }
+
+#ifdef KPSE_DEBUG
+  if (KPATHSEA_DEBUG_P (KPSE_DEBUG_HASH)) {
+    DEBUGF2 ("db_lookup(%s) => %u entries\n", key, STR_LIST_LENGTH (ret));
+  }
+#endif
+
+  /* If we found anything, mark end of list with null.  */
+  if (STR_LIST (ret))
+    cstr_list_add (&ret, NULL);
+
+  return STR_LIST (ret);
+}
+
+/* Collects the entries of an ls-R for kpathsea_db_compile.  */
+
+typedef struct
+{
+  string *names;
+  unsigned *entry_dirs;         /* directory number of each entry */
+  unsigned count, alloc;
+  const_string *dirs;
+  unsigned dir_count, dir_alloc;
+} db_compiler_type;
+
+static void
+db_compile_entry (void *closure, const_string name, const_string dir)
+{
+  db_compiler_type *c = (db_compiler_type *) closure;
+
+  if (c->dir_count == 0 || c->dirs[c->dir_count - 1] != dir) {
+    if (c->dir_count == c->dir_alloc) {
+      c->dir_alloc = c->dir_alloc ? 2 * c->dir_alloc : 1024;
+      XRETALLOC (c->dirs, c->dir_alloc, const_string);
+    }
+    c->dirs[c->dir_count++] = dir;
+  }
+
+  if (c->count == c->alloc) {
+    c->alloc = c->alloc ? 2 * c->alloc : 16384;
+    XRETALLOC (c->names, c->alloc, string);
+    XRETALLOC (c->entry_dirs, c->alloc, unsigned);
+  }
+  c->names[c->count] = xstrdup (name);
+  c->entry_dirs[c->count++] = c->dir_count - 1;
+}
+
+boolean
+kpathsea_db_compile (kpathsea kpse, const_string db_filename)
+{
+  db_compiler_type c;
+  db_index_header h;
+  db_index_key *keys;
+  unsigned *slots, *first, *last, *next, *entries, *dir_offsets;
+  unsigned dir_count = 0, ignore_dir_count = 0;
+  unsigned d, e, i, k, n, mask, offset;
+  string top_dir = db_top_dir (db_filename);
+  string index_name, temp_name;
+  struct stat db_stat;
+  FILE *f = fopen (db_filename, FOPEN_R_MODE);
+  boolean ok;
+
+  if (!f || fstat (fileno (f), &db_stat) != 0) {
+    perror (db_filename);
+    if (f)
+      fclose (f);
+    free (top_dir);
+    return false;
+  }
+
+  memset (&c, 0, sizeof (c));
+  db_read (kpse, f, top_dir, db_compile_entry, &c,
+           &dir_count, &ignore_dir_count);
+  xfclose (f, db_filename);
+
+  if (c.count == 0) {
+    WARNING1 ("kpathsea: %s: No usable entries in ls-R", db_filename);
+    free (top_dir);
+    return false;
+  }
+
+  memset (&h, 0, sizeof (h));
+  memcpy (h.magic, DB_INDEX_MAGIC, sizeof (h.magic));
+  h.byte_order = DB_INDEX_BYTE_ORDER;
+  h.header_size = sizeof (db_index_header);
+  db_index_split (db_stat.st_size, h.db_size);
+  db_index_split (db_stat.st_mtime, h.db_mtime);
+  h.entry_count = c.count;
+  h.dir_count = c.dir_count;
+
+  /* Hash the names, chaining the entries of each distinct name.  */
+  for (h.slot_count = 2; h.slot_count < 2 * c.count; h.slot_count <<= 1)
+    ;
+  mask = h.slot_count - 1;
+  slots = XTALLOC (h.slot_count, unsigned);
+  memset (slots, 0, h.slot_count * sizeof (unsigned));
+  first = XTALLOC (c.count, unsigned);
+  last = XTALLOC (c.count, unsigned);
+  next = XTALLOC (c.count, unsigned);   /* entry number + 1, or 0 */
+
+  for (e = 0; e < c.count; e++) {
+    n = db_index_hash (c.names[e]) & mask;
+    while (slots[n] && !STREQ (c.names[first[slots[n] - 1]], c.names[e]))
+      n = (n + 1) & mask;
+    next[e] = 0;
+    if (slots[n]) {
+      k = slots[n] - 1;
+      next[last[k]] = e + 1;
+      last[k] = e;
+    } else {
+      k = h.key_count++;
+      slots[n] = k + 1;
+      first[k] = last[k] = e;
+    }
+  }
+
+  /* Lay out the entries key by key, then the strings: the top
+     directory, the directories, and the names.  */
+  keys = XTALLOC (h.key_count, db_index_key);
+  entries = XTALLOC (c.count, unsigned);
+  dir_offsets = XTALLOC (c.dir_count, unsigned);
+  offset = strlen (top_dir) + 1;
+  for (d = 0; d < c.dir_count; d++) {
+    dir_offsets[d] = offset;
+    offset += strlen (c.dirs[d]) + 1;
+  }
+  for (k = 0, i = 0; k < h.key_count; k++) {
+    keys[k].name = offset;
+    offset += strlen (c.names[first[k]]) + 1;
+    keys[k].first = i;
+    for (e = first[k] + 1; e; e = next[e - 1])
+      entries[i++] = c.entry_dirs[e - 1];
+    keys[k].count = i - keys[k].first;
+  }
+  h.string_size = offset;
+
+  /* Write it under a temporary name, so no one maps half a file.  */
+  index_name = concat (db_filename, DB_INDEX_SUFFIX);
+  temp_name = concat (index_name, ".tmp");
+  f = fopen (temp_name, FOPEN_WBIN_MODE);
+  ok = f != NULL;
+  if (ok) {
+    fwrite (&h, sizeof (h), 1, f);
+    fwrite (slots, sizeof (unsigned), h.slot_count, f);
+    fwrite (keys, sizeof (db_index_key), h.key_count, f);
+    fwrite (entries, sizeof (unsigned), h.entry_count, f);
+    fwrite (dir_offsets, sizeof (unsigned), h.dir_count, f);
+    fwrite (top_dir, 1, strlen (top_dir) + 1, f);
+    for (d = 0; d < c.dir_count; d++)
+      fwrite (c.dirs[d], 1, strlen (c.dirs[d]) + 1, f);
+    for (k = 0; k < h.key_count; k++)
+      fwrite (c.names[first[k]], 1, strlen (c.names[first[k]]) + 1, f);
+    ok = !ferror (f);
+    ok = fclose (f) == 0 && ok;
+  }
+#if defined(WIN32)
+  if (ok)
+    unlink (index_name);
+#endif
+  if (!ok || rename (temp_name, index_name) != 0) {
+    perror (temp_name);
+    unlink (temp_name);
+    ok = false;
+  }
+
+#ifdef KPSE_DEBUG
+  if (ok && KPATHSEA_DEBUG_P (KPSE_DEBUG_HASH)) {
+    DEBUGF4 ("%s: %u entries, %u names in %u directories.\n",
+             index_name, h.entry_count, h.key_count, h.dir_count);
+  }
+#endif
+
+  for (e = 0; e < c.count; e++)
+    free (c.names[e]);
+  free (c.names);
+  free (c.entry_dirs);
+  /* The directory names are the strings built by db_read.  */
+  for (d = 0; d < c.dir_count; d++)
+    free ((string) c.dirs[d]);
+  free ((void *) c.dirs);
+  free (slots);
+  free (first);
+  free (last);
+  free (next);
+  free (keys);
+  free (entries);
+  free (dir_offsets);
+  free (index_name);
+  free (temp_name);
+  free (top_dir);
+
+  return ok;
+}
 
 /* Insert FNAME into the hash table.  This is for files that get built
    during a run.  We wouldn't want to reread all of ls-R, even if it got
@@ -211,6 +699,37 @@ kpathsea_db_insert (kpathsea kpse, const_string passed_fname)
   }
 }
 
+/* Unmap the compiled indexes and drop the tables of the text ls-R's
+   among them.  The hash tables themselves are only freed where the rest
+   of the library frees them (see kpathsea.c).  */
+
+void
+kpathsea_db_free (kpathsea kpse)
+{
+  unsigned p;
+
+  for (p = 0; p < kpse->db_part_count; p++) {
+    struct kpse_db_part *part = &kpse->db_parts[p];
+    if (part->index) {
+#if defined(WIN32)
+      free ((void *) part->index->header);
+#else
+      munmap ((void *) part->index->header, part->index->size);
+#endif
+      free (part->index);
+    }
+    if (part->table) {
+#if KPATHSEA_CAN_FREE
+      hash_free (*part->table);
+#endif
+      free (part->table);
+    }
+  }
+  free (kpse->db_parts);
+  kpse->db_parts = NULL;
+  kpse->db_part_count = 0;
+}
+
 /* Return true if FILENAME could be in PATH_ELT, i.e., if the directory
    part of FILENAME matches PATH_ELT.  Have to consider // wildcards, but
    $ and ~ expansion have already been done.  */
@@ -445,11 +964,51 @@ kpathsea_init_db (kpathsea kpse)
      kpse_db_search recursively), so kpse->db.buckets stays NULL.  */
   kpse->db = hash_create (DB_HASH_SIZE);
 
-  while (db_files && *db_files) {
-    if (db_build (kpse, &(kpse->db), *db_files))
-      ok = true;
-    free (*db_files);
-    db_files++;
+  {
+    unsigned n, i, after_last_index = 0;
+    db_index_type **indexes;
+    hash_table_type *table = NULL;
+
+    /* See which ls-R's have an up to date compiled index first, since
+       the text of the ones after the last index goes into kpse->db.  */
+    for (n = 0; db_files[n]; n++)
+      ;
+    indexes = XTALLOC (n + 1, db_index_type *);
+    for (i = 0; i < n; i++) {
+      string top_dir = db_top_dir (db_files[i]);
+      indexes[i] = db_index_open (kpse, db_files[i], top_dir);
+      if (indexes[i]) {
+        str_list_add (&(kpse->db_dir_list), top_dir);
+        after_last_index = i + 1;
+        ok = true;
+      } else
+        free (top_dir);
+    }
+
+    for (i = 0; i < n; i++) {
+      if (indexes[i] || i < after_last_index) {
+        if (indexes[i] || !table) {
+          XRETALLOC (kpse->db_parts, kpse->db_part_count + 1,
+                     struct kpse_db_part);
+          kpse->db_parts[kpse->db_part_count].index = indexes[i];
+          kpse->db_parts[kpse->db_part_count].table = NULL;
+          if (!indexes[i]) {
+            table = XTALLOC1 (hash_table_type);
+            *table = hash_create (DB_HASH_SIZE);
+            kpse->db_parts[kpse->db_part_count].table = table;
+          } else
+            table = NULL;
+          kpse->db_part_count++;
+        }
+      }
+      if (!indexes[i]
+          && db_build (kpse, i < after_last_index ? table : &(kpse->db),
+                       db_files[i]))
+        ok = true;
+      free (db_files[i]);
+    }
+
+    free (indexes);
   }
 
   if (!ok) {
@@ -564,7 +1123,7 @@ kpathsea_db_search (kpathsea kpse, const_string name,
     const_string ctry = *r;
 
     /* We have an ls-R db.  Look up `try'.  */
-    orig_dirs = db_dirs = hash_lookup (kpse->db, ctry);
+    orig_dirs = db_dirs = db_lookup (kpse, ctry);
 
     ret = XTALLOC1 (str_list_type);
     *ret = str_list_init ();
@@ -725,7 +1284,7 @@ kpathsea_db_search_list (kpathsea kpse, string* names,
           const_string ctry = *r;
 
           /* We have an ls-R db.  Look up `try'.  */
-          orig_dirs = db_dirs = hash_lookup (kpse->db, ctry);
+          orig_dirs = db_dirs = db_lookup (kpse, ctry);
 
           /* For each filename found, see if it matches the path element.  For
              example, if we have .../cx/cmr10.300pk and .../ricoh/cmr10.300pk,
@@ -19,12 +19,12 @@
 #ifndef KPATHSEA_DB_H
 #define KPATHSEA_DB_H
 
-#ifdef MAKE_KPSE_DLL /* libkpathsea internal only */
-
 #include <kpathsea/c-proto.h>
 #include <kpathsea/types.h>
 #include <kpathsea/str-list.h>
 
+#ifdef MAKE_KPSE_DLL /* libkpathsea internal only */
+
 /* Initialize the database.  Until this is called, no ls-R matches will
    be found.  */
 extern void kpathsea_init_db (kpathsea kpse);
@@ -48,6 +48,16 @@ extern str_list_type *kpathsea_db_search_list (kpathsea kpse,
    Called by mktex() in tex-make.c.  */
 extern void kpathsea_db_insert (kpathsea kpse, const_string fname);
 
+/* Release the compiled indexes and the tables of the ls-R's before them.
+   Called by kpathsea_finish.  */
+extern void kpathsea_db_free (kpathsea kpse);
+
 #endif /* MAKE_KPSE_DLL */
 
+/* Write the compiled index of the ls-R file DB_FILENAME, which
+   kpathsea_init_db then uses instead of reading the text, as long as
+   the ls-R doesn't change.  Return false if that fails.  */
+extern KPSEDLL boolean kpathsea_db_compile (kpathsea kpse,
+                                            const_string db_filename);
+
 #endif /* not KPATHSEA_DB_H */
@@ -18,15 +18,28 @@
 
 #include <kpathsea/config.h>
 
+#include <kpathsea/absolute.h>
+#include <kpathsea/c-fopen.h>
 #include <kpathsea/c-pathch.h>
+#include <kpathsea/c-stat.h>
 #include <kpathsea/expand.h>
 #include <kpathsea/fn.h>
+#include <kpathsea/hash.h>
+#include <kpathsea/line.h>
 #include <kpathsea/pathsearch.h>
+#include <kpathsea/variable.h>
 #include <kpathsea/xopendir.h>
 
+#include <time.h> /* for `time' */
+
 /* To avoid giving prototypes for all the routines and then their real
    definitions, we give all the subroutines first.  The entry point is
    the last routine in the file.  */
+
+/* Remember that DIR (or the parent of DIR) was read while expanding a
+   path element, if the expansion is going to the persistent cache.  */
+static void dir_cache_note (kpathsea, const_string);
+static void dir_cache_note_parent (kpathsea, const_string);
 
 /* Make a copy of DIR (unless it's null) and save it in L.  Ensure that
    DIR ends with a DIR_SEP for the benefit of later searches.  */
@@ -49,6 +62,9 @@ dir_list_add (str_llist_type *l, string dir)
 static void
 checked_dir_list_add (kpathsea kpse, str_llist_type *l, string dir)
 {
+  /* Whether DIR exists is up to its parent.  */
+  dir_cache_note_parent (kpse, dir);
+
     if (kpathsea_dir_p (kpse, dir))
     dir_list_add (l, dir);
 }
@@ -59,11 +75,16 @@ checked_dir_list_add (kpathsea kpse, str_llist_type *l, string dir)
    the dir_links call, that's not enough -- without this path element
    caching as well, the execution time doubles.  */
 
-/* Associate KEY with VALUE.  We implement the cache as a simple linear
-   list, since it's unlikely to ever be more than a dozen or so elements
-   long.  We don't bother to check here if PATH has already been saved;
-   we always add it to our list.  We copy KEY but not VALUE; not sure
-   that's right, but it seems to be all that's needed.  */
+/* Associate KEY with VALUE.  The list is what kpathsea_finish frees;
+   lookups go through a hash table, since with a few dozen formats each
+   contributing their // elements, a linear search shows up in the
+   profile.  We don't bother to check here if PATH has already been
+   saved; we always add it to our list.  We copy KEY but not VALUE; not
+   sure that's right, but it seems to be all that's needed.  */
+
+#ifndef ELT_CACHE_HASH_SIZE
+#define ELT_CACHE_HASH_SIZE 503
+#endif
 
 static void
 cache (kpathsea kpse, const_string key,  str_llist_type *value)
@@ -72,25 +93,391 @@ cache (kpathsea kpse, const_string key,  str_llist_type *value)
   XRETALLOC (kpse->the_cache, kpse->cache_length, cache_entry);
   kpse->the_cache[kpse->cache_length - 1].key = xstrdup (key);
   kpse->the_cache[kpse->cache_length - 1].value = value;
+
+  if (kpse->cache_table.size == 0)
+    kpse->cache_table = hash_create (ELT_CACHE_HASH_SIZE);
+
+  /* As in dir.c, the value is stored as a string.  */
+  hash_insert (&kpse->cache_table, kpse->the_cache[kpse->cache_length - 1].key,
+               (const_string) value);
 }
 
 
-/* To retrieve, just check the list in order.  */
+/* Return the first value saved for KEY in TABLE, or the last one if
+   LAST is true; NULL if there is none.  */
+
+static const_string
+cache_lookup (kpathsea kpse, hash_table_type table, const_string key,
+              boolean last)
+{
+  const_string *hash_ret;
+  const_string ret = NULL;
+
+  if (table.size == 0)
+    return NULL;
+
+#ifdef KPSE_DEBUG
+  if (KPATHSEA_DEBUG_P (KPSE_DEBUG_HASH))
+    kpse->debug_hash_lookup_int = true;
+#endif
+
+  hash_ret = hash_lookup (table, key);
+
+#ifdef KPSE_DEBUG
+  if (KPATHSEA_DEBUG_P (KPSE_DEBUG_HASH))
+    kpse->debug_hash_lookup_int = false;
+#endif
+
+  if (hash_ret) {
+    const_string *r = hash_ret;
+    if (last)
+      while (r[1])
+        r++;
+    ret = *r;
+    free ((void *) hash_ret);
+  }
+
+  return ret;
+}
 
 static str_llist_type *
 cached (kpathsea kpse, const_string key)
 {
-  unsigned p;
+  return (str_llist_type *) cache_lookup (kpse, kpse->cache_table, key, false);
+}
 
-  for (p = 0; p < kpse->cache_length; p++)
-    {
-      if (FILESTRCASEEQ (kpse->the_cache[p].key, key))
-        return kpse->the_cache[p].value;
+/* The persistent cache.  If TEXMFDIRCACHE names a file, the expansions
+   of absolute elements with a // are also kept there from one run to
+   the next, together with the modification times of the directories
+   that were read to find them.  As long as none of those directories
+   has changed, later runs take the expansion from the file instead of
+   walking the tree again.
+
+   Each expansion is appended to the file as lines
+     e ELT              the element;
+     m MTIME DIR        a directory that was read, -1 if it didn't exist;
+     d DIR              the directories ELT expands to, in order;
+     . ELT              the end of it.
+   An expansion that isn't complete is ignored, so that a run which is
+   interrupted, or a concurrent one, does no harm.  A later expansion
+   of ELT supersedes an earlier one; when too many expansions have been
+   superseded, the file is rewritten.  Lines beginning with `%' are
+   comments.  */
+
+#define DIR_CACHE_MAGIC "% kpathsea directory cache, version 1\n"
+
+struct kpse_dir_cache
+{
+  string file_name;             /* NULL if there is no persistent cache */
+  hash_table_type table;        /* elements => the text of their records */
+  str_list_type elts;           /* the elements, in order */
+  unsigned records;             /* the complete records in the file */
+  boolean recording;            /* true while expanding for the file */
+  boolean unstable;             /* a directory changed while we read it */
+  time_t start;                 /* when the expansion began */
+  string rec;                   /* the m lines so far */
+  unsigned rec_length, rec_size;
+};
+
+/* Start a new record in DC.  */
+
+static void
+dir_cache_clear (struct kpse_dir_cache *dc)
+{
+  dc->rec_length = 0;
+  if (dc->rec)
+    dc->rec[0] = 0;
+}
+
+/* Append S1, S2 and S3 to the record in DC.  */
+
+static void
+dir_cache_append (struct kpse_dir_cache *dc, const_string s1,
+                  const_string s2, const_string s3)
+{
+  unsigned len1 = strlen (s1), len2 = strlen (s2), len3 = strlen (s3);
+  unsigned need = dc->rec_length + len1 + len2 + len3 + 1;
+
+  if (need > dc->rec_size) {
+    dc->rec_size = need > 2 * dc->rec_size ? need : 2 * dc->rec_size;
+    XRETALLOC (dc->rec, dc->rec_size, char);
+  }
+  memcpy (dc->rec + dc->rec_length, s1, len1);
+  memcpy (dc->rec + dc->rec_length + len1, s2, len2);
+  memcpy (dc->rec + dc->rec_length + len1 + len2, s3, len3);
+  dc->rec_length += len1 + len2 + len3;
+  dc->rec[dc->rec_length] = 0;
+}
+
+static void
+dir_cache_note (kpathsea kpse, const_string dir)
+{
+  struct kpse_dir_cache *dc = kpse->dir_cache;
+  struct stat st;
+  long mtime = -1;
+  char buf[32];
+
+  if (!dc || !dc->recording)
+    return;
+
+  if (stat (dir, &st) == 0) {
+    mtime = (long) st.st_mtime;
+    /* If DIR changed this second or the last, it could change again
+       without its time changing; don't trust the expansion.  */
+    if (st.st_mtime + 1 >= dc->start)
+      dc->unstable = true;
+  }
+  sprintf (buf, "m %ld ", mtime);
+  dir_cache_append (dc, buf, dir, "\n");
+}
+
+static void
+dir_cache_note_parent (kpathsea kpse, const_string dir)
+{
+  string parent, p;
+
+  if (!kpse->dir_cache || !kpse->dir_cache->recording)
+    return;
+
+  parent = xstrdup (dir);
+  p = parent + strlen (parent);
+  while (p > parent && IS_DIR_SEP_CH (p[-1]))
+    p--;
+  while (p > parent && !IS_DIR_SEP_CH (p[-1]))
+    p--;
+  if (p > parent) {
+    *p = 0;
+    dir_cache_note (kpse, parent);
+  }
+  free (parent);
+}
+
+/* Write the records in DC, one for each element, to its file.  We
+   write a new file and rename it, so readers see either the old one or
+   the new one.  */
+
+static void
+dir_cache_rewrite (kpathsea kpse, struct kpse_dir_cache *dc)
+{
+  string tmp_name = concat (dc->file_name, ".tmp");
+  FILE *f = fopen (tmp_name, FOPEN_W_MODE);
+  unsigned e;
+  boolean ok;
+
+  if (!f) {
+    free (tmp_name);
+    return;
+  }
+
+  ok = fputs (DIR_CACHE_MAGIC, f) != EOF;
+  for (e = 0; ok && e < STR_LIST_LENGTH (dc->elts); e++) {
+    const_string elt = STR_LIST_ELT (dc->elts, e);
+    const_string rec = cache_lookup (kpse, dc->table, elt, true);
+    ok = fprintf (f, "e %s\n%s. %s\n", elt, rec, elt) >= 0;
+  }
+  if (fclose (f) == EOF || !ok || rename (tmp_name, dc->file_name) != 0)
+    unlink (tmp_name);
+  else
+    dc->records = STR_LIST_LENGTH (dc->elts);
+
+#ifdef KPSE_DEBUG
+  if (KPATHSEA_DEBUG_P (KPSE_DEBUG_EXPAND))
+    DEBUGF2 ("dir cache: rewrote %s with %u elements\n", dc->file_name,
+             STR_LIST_LENGTH (dc->elts));
+#endif
+
+  free (tmp_name);
+}
+
+/* Read the file of DC into its hash table.  */
+
+static void
+dir_cache_read (kpathsea kpse, struct kpse_dir_cache *dc)
+{
+  FILE *f = fopen (dc->file_name, FOPEN_R_MODE);
+  string line;
+  string elt = NULL;
+
+  if (!f)
+    return;
+
+  dir_cache_clear (dc);
+  while ((line = read_line (f)) != NULL) {
+    if (line[0] == 'e' && line[1] == ' ') {
+      free (elt);
+      elt = xstrdup (line + 2);
+      dir_cache_clear (dc);
+
+    } else if (elt && (line[0] == 'm' || line[0] == 'd') && line[1] == ' ') {
+      dir_cache_append (dc, line, "\n", "");
+
+    } else if (elt && line[0] == '.' && line[1] == ' ') {
+      if (FILESTRCASEEQ (line + 2, elt)) {
+        if (!cache_lookup (kpse, dc->table, elt, false))
+          str_list_add (&dc->elts, elt);
+        hash_insert (&dc->table, elt, xstrdup (dc->rec ? dc->rec : ""));
+        dc->records++;
+      } else
+        free (elt);
+      elt = NULL;
+      dir_cache_clear (dc);
     }
+    free (line);
+  }
+  free (elt);
+  dir_cache_clear (dc);
+  fclose (f);
 
-  return NULL;
+  if (dc->records > 2 * STR_LIST_LENGTH (dc->elts) + 16)
+    dir_cache_rewrite (kpse, dc);
 }
-
+
+/* Return the persistent cache, or NULL if there isn't one.  We can't
+   look at TEXMFDIRCACHE while the configuration files are being read;
+   the searches for them just go without.  */
+
+static struct kpse_dir_cache *
+dir_cache_get (kpathsea kpse)
+{
+  if (!kpse->dir_cache) {
+    string name;
+
+    if (kpse->doing_cnf_init)
+      return NULL;
+
+    /* Set this first: finding the value may expand path elements.  */
+    kpse->dir_cache = XTALLOC1 (struct kpse_dir_cache);
+    memset (kpse->dir_cache, 0, sizeof (struct kpse_dir_cache));
+
+    name = kpathsea_var_value (kpse, "TEXMFDIRCACHE");
+    if (name && *name) {
+      kpse->dir_cache->file_name = name;
+      kpse->dir_cache->table = hash_create (ELT_CACHE_HASH_SIZE);
+      dir_cache_read (kpse, kpse->dir_cache);
+    } else
+      free (name);
+  }
+
+  return kpse->dir_cache->file_name ? kpse->dir_cache : NULL;
+}
+
+/* Return a copy of the text from START up to END.  */
+
+static string
+dir_cache_substring (const_string start, const_string end)
+{
+  string ret = XTALLOC (end - start + 1, char);
+
+  memcpy (ret, start, end - start);
+  ret[end - start] = 0;
+  return ret;
+}
+
+/* If the persistent cache has an expansion of ELT whose directories
+   haven't changed since, append it to RET and return true.  */
+
+static boolean
+dir_cache_lookup (kpathsea kpse, struct kpse_dir_cache *dc, const_string elt,
+                  str_llist_type *ret)
+{
+  const_string rec = cache_lookup (kpse, dc->table, elt, true);
+  const_string line, end;
+  struct stat st;
+
+  if (!rec)
+    return false;
+
+  for (line = rec; *line == 'm'; line = end + 1) {
+    string after, dir;
+    long mtime = strtol (line + 2, &after, 10);
+    boolean same;
+
+    end = strchr (line, '\n');
+    if (*after != ' ' || after >= end)
+      return false;
+    dir = dir_cache_substring (after + 1, end);
+    if (stat (dir, &st) == 0)
+      same = (long) st.st_mtime == mtime;
+    else
+      same = mtime == -1;
+    if (!same) {
+#ifdef KPSE_DEBUG
+      if (KPATHSEA_DEBUG_P (KPSE_DEBUG_EXPAND))
+        DEBUGF2 ("dir cache: %s has changed, expanding %s\n", dir, elt);
+#endif
+      free (dir);
+      return false;
+    }
+    free (dir);
+  }
+
+  for (; *line == 'd'; line = end + 1) {
+    end = strchr (line, '\n');
+    str_llist_add (ret, dir_cache_substring (line + 2, end));
+  }
+
+#ifdef KPSE_DEBUG
+  if (KPATHSEA_DEBUG_P (KPSE_DEBUG_EXPAND))
+    DEBUGF2 ("dir cache: %s from %s\n", elt, dc->file_name);
+#endif
+
+  return true;
+}
+
+/* Append the expansion RET of ELT, recorded while it was computed, to
+   the file of DC.  The whole record goes out with one write, so that
+   records from concurrent runs don't get mixed up.  */
+
+static void
+dir_cache_save (kpathsea kpse, struct kpse_dir_cache *dc, const_string elt,
+                str_llist_type *ret)
+{
+  str_llist_elt_type *e;
+  FILE *f;
+
+  dc->recording = false;
+  if (dc->unstable) {
+#ifdef KPSE_DEBUG
+    if (KPATHSEA_DEBUG_P (KPSE_DEBUG_EXPAND))
+      DEBUGF1 ("dir cache: %s is changing, not saved\n", elt);
+#endif
+    return;
+  }
+
+  for (e = *ret; e; e = STR_LLIST_NEXT (*e))
+    dir_cache_append (dc, "d ", STR_LLIST (*e), "\n");
+
+  f = fopen (dc->file_name, FOPEN_A_MODE);
+  if (f) {
+    string text = concat3 ("e ", elt, "\n");
+    string all;
+    boolean ok;
+
+    all = concat3 (text, dc->rec ? dc->rec : "", ". ");
+    free (text);
+    text = concat3 (all, elt, "\n");
+    free (all);
+
+    /* The buffer has to be set before anything else is done with F.  */
+    setvbuf (f, NULL, _IOFBF, strlen (DIR_CACHE_MAGIC) + strlen (text) + 1);
+    fseek (f, 0, SEEK_END);
+    if (ftell (f) == 0) {
+      all = concat (DIR_CACHE_MAGIC, text);
+      free (text);
+      text = all;
+    }
+    ok = fputs (text, f) != EOF;
+    if (fclose (f) != EOF && ok) {
+      string key = xstrdup (elt);
+      if (!cache_lookup (kpse, dc->table, key, false))
+        str_list_add (&dc->elts, key);
+      hash_insert (&dc->table, key, xstrdup (dc->rec ? dc->rec : ""));
+      dc->records++;
+    }
+    free (text);
+  }
+}
+
 /* Handle the magic path constructs.  */
 
 /* Declare recursively called routine.  */
@@ -134,6 +521,7 @@ do_subdir (kpathsea kpse, str_llist_type *str_list_ptr, string elt,
   strcpy(dirname, FN_STRING(name));
   strcat(dirname, "/*.*");         /* "*.*" or "*" -- seems equivalent. */
   get_wstring_from_fsyscp(dirname, dirnamew);
+  dir_cache_note (kpse, FN_STRING (name));
   hnd = FindFirstFileW(dirnamew, &find_file_data);
 
   if (hnd == INVALID_HANDLE_VALUE) {
@@ -195,10 +583,14 @@ do_subdir (kpathsea kpse, str_llist_type *str_list_ptr, string elt,
           /* All criteria are met; find subdirectories.  */
         do_subdir (kpse, str_list_ptr, FN_STRING (name),
                      potential_len, post);
-        else if (*post == 0)
-          /* Nothing to match, no recursive subdirectories to
-             look for: we're done with this branch.  Add it.  */
-          dir_list_add (str_list_ptr, FN_STRING (name));
+        else {
+          /* Its subdirectories don't matter, but that it has none does.  */
+          dir_cache_note (kpse, FN_STRING (name));
+          if (*post == 0)
+            /* Nothing to match, no recursive subdirectories to
+               look for: we're done with this branch.  Add it.  */
+            dir_list_add (str_list_ptr, FN_STRING (name));
+        }
       }
       fn_shrink_to (&name, elt_length);
     }
@@ -212,6 +604,7 @@ do_subdir (kpathsea kpse, str_llist_type *str_list_ptr, string elt,
 #else /* not WIN32 */
 
   /* If we can't open it, quit.  */
+  dir_cache_note (kpse, FN_STRING (name));
   dir = opendir (FN_STRING (name));
   if (dir == NULL)
     {
@@ -287,10 +680,16 @@ do_subdir (kpathsea kpse, str_llist_type *str_list_ptr, string elt,
                   do_subdir (kpse, str_list_ptr, FN_STRING (name),
                            potential_len, post);
 #ifdef ST_NLINK_TRICK
-              else if (*post == 0)
-                /* Nothing to match, no recursive subdirectories to
-                   look for: we're done with this branch.  Add it.  */
-                dir_list_add (str_list_ptr, FN_STRING (name));
+              else
+                {
+                  /* Its subdirectories don't matter, but that it has
+                     none does.  */
+                  dir_cache_note (kpse, FN_STRING (name));
+                  if (*post == 0)
+                    /* Nothing to match, no recursive subdirectories to
+                       look for: we're done with this branch.  Add it.  */
+                    dir_list_add (str_list_ptr, FN_STRING (name));
+                }
 #endif
             }
 
@@ -405,6 +804,7 @@ str_llist_type *
 kpathsea_element_dirs (kpathsea kpse, string elt)
 {
   str_llist_type *ret;
+  struct kpse_dir_cache *dc;
   unsigned i;
 
   /* If given nothing, return nothing.  */
@@ -423,8 +823,36 @@ kpathsea_element_dirs (kpathsea kpse, string elt)
   ret = XTALLOC1 (str_llist_type);
   *ret = NULL;
 
-  /* We handle the hard case in a subroutine.  */
-  expand_elt (kpse, ret, elt, i);
+  /* Absolute elements with a // may be in the persistent cache; if
+     not, we record what we read to find them, to put them there.  */
+  dc = NULL;
+  if (kpathsea_absolute_p (kpse, elt, false))
+    {
+      string p;
+      for (p = elt + i; *p; p++)
+        if (IS_DIR_SEP_CH (p[0]) && IS_DIR_SEP_CH (p[1]))
+          {
+            dc = dir_cache_get (kpse);
+            break;
+          }
+    }
+
+  if (!dc || !dir_cache_lookup (kpse, dc, elt, ret))
+    {
+      if (dc)
+        {
+          dc->recording = true;
+          dc->unstable = false;
+          dc->start = time (NULL);
+          dir_cache_clear (dc);
+        }
+
+      /* We handle the hard case in a subroutine.  */
+      expand_elt (kpse, ret, elt, i);
+
+      if (dc)
+        dir_cache_save (kpse, dc, elt, ret);
+    }
 
   /* Remember the directory list we just found, in case future calls are
      made with the same ELT.  */
@@ -448,6 +876,52 @@ kpathsea_element_dirs (kpathsea kpse, string elt)
   return ret;
 }
 
+/* Free the elements and buckets of TABLE, and also their keys and
+   values if OWNED.  */
+
+static void
+table_free (hash_table_type *table, boolean owned)
+{
+  unsigned b;
+
+  if (!table->buckets)
+    return;
+  for (b = 0; b < table->size; b++) {
+    hash_element_type *p = table->buckets[b];
+    while (p) {
+      hash_element_type *q = p->next;
+      if (owned) {
+        free ((string) p->key);
+        free ((string) p->value);
+      }
+      free (p);
+      p = q;
+    }
+  }
+  free (table->buckets);
+  table->buckets = NULL;
+  table->size = 0;
+}
+
+void
+kpathsea_element_dirs_free (kpathsea kpse)
+{
+  struct kpse_dir_cache *dc = kpse->dir_cache;
+
+  /* The keys are those of the_cache, freed with it.  */
+  table_free (&kpse->cache_table, false);
+
+  if (dc) {
+    /* The elements listed are keys of the table too.  */
+    table_free (&dc->table, true);
+    str_list_free (&dc->elts);
+    free (dc->file_name);
+    free (dc->rec);
+    free (dc);
+    kpse->dir_cache = NULL;
+  }
+}
+
 #ifdef TEST
 
 void
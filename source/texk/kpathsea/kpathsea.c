@@ -23,6 +23,9 @@
  */
 
 #include <kpathsea/config.h>
+#include <kpathsea/db.h>
+#include <kpathsea/pathsearch.h>
+#include <kpathsea/tex-file.h>
 
 kpathsea
 kpathsea_new (void)
@@ -113,6 +116,12 @@ kpathsea_finish (kpathsea kpse)
         free (kpse->saved_env);
     }
 #endif /* KPATHSEA_CAN_FREE */
+    kpathsea_db_free (kpse);
+    kpathsea_element_dirs_free (kpse);
+    kpathsea_find_file_cache_flush (kpse);
+    free (kpse->find_file_cache.buckets);
+    kpse->find_file_cache.buckets = NULL;
+    kpse->find_file_cache.size = 0;
 #if defined(WIN32) || defined(__CYGWIN__)
     if (kpse->suffixlist != NULL) {
         char **p;
@@ -19,6 +19,7 @@
 #include <kpathsea/config.h>
 #include <kpathsea/c-ctype.h>
 #include <kpathsea/c-pathch.h>
+#include <kpathsea/db.h>
 #include <kpathsea/expand.h>
 #include <kpathsea/getopt.h>
 #include <kpathsea/line.h>
@@ -45,6 +46,9 @@ string path_to_expand = NULL;
 string path_to_show = NULL;
 string var_to_value = NULL;
 
+/* The ls-R to write a compiled index for.  (-compile-db) */
+string db_to_compile = NULL;
+
 /* Base resolution. (-D, -dpi) */
 unsigned dpi = 600;
 
@@ -424,6 +428,7 @@ to also use -engine, or nothing will be returned; in particular,\n\
 -engine=/ will return matching format files for any engine.\n\
 \n\
 -all                   output all matches, one per line.\n\
+-compile-db=FILE       write the compiled index for the ls-R file FILE.\n\
 -debug=NUM             set debugging flags.\n\
 -D, -dpi=NUM           use a base resolution of NUM; default 600.\n\
 -engine=STRING         set engine name to STRING.\n\
@@ -527,6 +532,7 @@ help_formats (kpathsea kpse, string *argv)
 static struct option long_options[]
   = { { "D",                    1, 0, 0 },
       { "all",                  0, (int *) &show_all, 1 },
+      { "compile-db",           1, 0, 0 },
       { "debug",                1, 0, 0 },
       { "dpi",                  1, 0, 0 },
       { "engine",               1, 0, 0 },
@@ -568,7 +574,10 @@ read_command_line (kpathsea kpse, int argc, string *argv)
 
     assert (g == 0); /* We have no short option names.  */
 
-    if (ARGUMENT_IS ("debug")) {
+    if (ARGUMENT_IS ("compile-db")) {
+      db_to_compile = optarg;
+
+    } else if (ARGUMENT_IS ("debug")) {
       kpse->debug |= atoi (optarg);
 
     } else if (ARGUMENT_IS ("dpi") || ARGUMENT_IS ("D")) {
@@ -649,7 +658,7 @@ There is NO WARRANTY, to the extent permitted by law.\n");
 
   if (optind == argc
       && !var_to_expand && !braces_to_expand && !path_to_expand
-      && !path_to_show && !var_to_value
+      && !path_to_show && !var_to_value && !db_to_compile
       && !safe_in_name && !safe_out_name) {
     fputs ("Missing argument. Try `kpsewhich --help' for more information.\n",
            stderr);
@@ -762,6 +771,12 @@ main (int argc,  string *argv)
     puts (value);
   }
 
+  /* Compiled ls-R. */
+  if (db_to_compile) {
+    if (!kpathsea_db_compile (kpse, db_to_compile))
+      unfound++;
+  }
+
   if (safe_in_name) {
     if (!kpathsea_in_name_ok_silent (kpse, safe_in_name))
       unfound++;
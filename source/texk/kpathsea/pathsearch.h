@@ -64,6 +64,10 @@ extern unsigned kpathsea_normalize_path (kpathsea kpse, string elt);
 extern str_llist_type *kpathsea_element_dirs (kpathsea kpse,
                                                       string elt);
 
+/* Release the persistent directory cache and the hash of the element
+   cache.  Called by kpathsea_finish.  */
+extern void kpathsea_element_dirs_free (kpathsea kpse);
+
 #endif /* MAKE_KPSE_DLL */
 
 /* Call `kpathsea_expand' on NAME.  If the result is an absolute or
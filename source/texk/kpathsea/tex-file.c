@@ -1002,6 +1002,63 @@ kpse_find_file (const_string name,  kpse_file_format_type format,
 }
 #endif
 
+/* The answers of kpse_find_file, found or not, by format, MUST_EXIST
+   and name.  The same names are looked up over and over: TeX tries
+   several formats for each font, and LaTeX's \IfFileExists asks about
+   the same missing files again and again.  Failures are remembered as
+   the empty string.  */
+
+#ifndef FIND_FILE_CACHE_SIZE
+#define FIND_FILE_CACHE_SIZE 1009
+#endif
+
+static string
+find_file_cache_key (const_string name, kpse_file_format_type format,
+                     boolean must_exist)
+{
+  char prefix[16];
+
+  sprintf (prefix, "%d%c", (int) format, must_exist ? '+' : '-');
+  return concat (prefix, name);
+}
+
+/* Forget all the answers.  */
+
+void
+kpathsea_find_file_cache_flush (kpathsea kpse)
+{
+  unsigned b;
+
+  if (kpse->find_file_cache.size == 0)
+    return;
+
+#ifdef KPSE_DEBUG
+  if (KPATHSEA_DEBUG_P (KPSE_DEBUG_SEARCH))
+    DEBUGF2 ("kpse_find_file: flushing the cache after %u hits, %u misses\n",
+             kpse->find_file_hits, kpse->find_file_misses);
+#endif /* KPSE_DEBUG */
+
+  for (b = 0; b < kpse->find_file_cache.size; b++) {
+    hash_element_type *p = kpse->find_file_cache.buckets[b];
+    while (p) {
+      hash_element_type *next = p->next;
+      free ((string) p->key);
+      free ((string) p->value);
+      free (p);
+      p = next;
+    }
+    kpse->find_file_cache.buckets[b] = NULL;
+  }
+}
+
+#if defined (KPSE_COMPAT_API)
+void
+kpse_find_file_cache_flush (void)
+{
+  kpathsea_find_file_cache_flush (kpse_def);
+}
+#endif
+
 /* As with `kpse_find_file', but also allow passing ALL for the search,
    hence we always return a NULL-terminated list.  */
 
@@ -1022,6 +1079,7 @@ kpathsea_find_file_generic (kpathsea kpse, const_string const_name,
                           || format == kpse_pk_format
                           || format == kpse_ofm_format);
   string *ret = NULL;
+  string cache_key = NULL;
 
   /* NAME being NULL is a programming bug somewhere.  NAME can be empty,
      though; this happens with constructs like `\input\relax'.  */
@@ -1036,6 +1094,34 @@ kpathsea_find_file_generic (kpathsea kpse, const_string const_name,
              const_name, FMT_INFO.type, FMT_INFO.path_source);
 #endif /* KPSE_DEBUG */
 
+  /* Have we been asked this before?  */
+  if (!all) {
+    const_string *cached = NULL;
+
+    cache_key = find_file_cache_key (const_name, format, must_exist);
+    if (kpse->find_file_cache.size == 0)
+      kpse->find_file_cache = hash_create (FIND_FILE_CACHE_SIZE);
+    else
+      cached = hash_lookup (kpse->find_file_cache, cache_key);
+
+    if (cached) {
+      ret = XTALLOC (2, string);
+      ret[0] = **cached ? xstrdup (*cached) : NULL;
+      ret[1] = NULL;
+      free ((void *) cached);
+      free (cache_key);
+      kpse->find_file_hits++;
+#ifdef KPSE_DEBUG
+      if (KPATHSEA_DEBUG_P (KPSE_DEBUG_SEARCH))
+        DEBUGF4 ("kpse_find_file: cached %s (%u hits, %u misses) => %s\n",
+                 const_name, kpse->find_file_hits, kpse->find_file_misses,
+                 ret[0] ? ret[0] : "(nil)");
+#endif /* KPSE_DEBUG */
+      return ret;
+    }
+    kpse->find_file_misses++;
+  }
+
   /* Do variable and tilde expansion. */
   name = kpathsea_expand (kpse, const_name);
 
@@ -1131,6 +1217,10 @@ kpathsea_find_file_generic (kpathsea kpse, const_string const_name,
     }
   }
 
+  if (cache_key)
+    hash_insert (&kpse->find_file_cache, cache_key,
+                 xstrdup (*ret ? *ret : ""));
+
   free (name);
 
   return ret;
@@ -1421,6 +1511,9 @@ kpathsea_reset_program_name (kpathsea kpse, const_string progname)
   kpse->program_name = xstrdup (progname);
   kpathsea_xputenv(kpse, "progname", kpse->program_name);
 
+  /* The answers may be different now.  */
+  kpathsea_find_file_cache_flush (kpse);
+
   /* Clear paths -- do we want the db path to be cleared? */
   for (i = 0; i != kpse_last_format; ++i) {
     /* Do not erase the cnf of db paths.  This means that the filename
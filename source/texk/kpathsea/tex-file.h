@@ -77,6 +77,11 @@ extern KPSEDLL string *kpathsea_find_file_generic (kpathsea kpse,
      const_string name, kpse_file_format_type format, boolean must_exist,
      boolean all);
 
+/* `kpse_find_file' remembers its answers, including failures, until
+   this is called.  Clients must call it when they may have created a
+   file: after writing one, or running another program.  */
+extern KPSEDLL void kpathsea_find_file_cache_flush (kpathsea kpse);
+
 /* Return true if FNAME is acceptable to open for reading or writing.
    If not acceptable, write a message to stderr.  */
 extern KPSEDLL boolean kpathsea_in_name_ok (kpathsea kpse, const_string fname);
@@ -120,6 +125,8 @@ extern KPSEDLL string *kpse_find_file_generic
   (const_string name, kpse_file_format_type format,
       boolean must_exist, boolean all);
 
+extern KPSEDLL void kpse_find_file_cache_flush (void);
+
 extern KPSEDLL boolean kpse_in_name_ok (const_string fname);
 extern KPSEDLL boolean kpse_out_name_ok (const_string fname);
 
@@ -292,6 +292,17 @@ typedef struct kpathsea_instance {
     struct passwd the_passwd;
     int __system_allow_multiple_cmds;
 #endif /* WIN32 && !__MINGW32__ */
+    /* Members added since are kept here at the end, so that programs
+       built against the fields above still find them in place.  */
+    /* from db.c */
+    struct kpse_db_part *db_parts;      /* compiled ls-R's, in order */
+    unsigned db_part_count;
+    /* from elt-dirs.c */
+    hash_table_type cache_table;        /* the_cache, hashed by key */
+    struct kpse_dir_cache *dir_cache;   /* the persistent cache, if any */
+    /* from tex-file.c */
+    hash_table_type find_file_cache;    /* answers of kpse_find_file */
+    unsigned find_file_hits, find_file_misses;
 } kpathsea_instance;
 
 /* these come from kpathsea.c */
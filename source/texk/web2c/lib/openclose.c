@@ -304,6 +304,8 @@ open_output (FILE **f_ptr, const_string fopen_mode)
             strcpy (nameoffile + 1, fname);
         }
         recorder_record_output (fname);
+        /* Searches could find the new file now.  */
+        kpse_find_file_cache_flush ();
     }
     if (fname != nameoffile +1)
         free(fname);
@@ -553,6 +553,10 @@ runsystem (const char *cmd)
   else if (allow == 2)
     status =  system (safecmd);
 
+  /* The command may have written files we've looked for.  */
+  if (allow == 1 || allow == 2)
+    kpse_find_file_cache_flush ();
+
   /* Not really meaningful, but we have to manage the return value of system. */
   if (status != 0)
     fprintf(stderr,"system returned with code %d\n", status); 
@@ -604,6 +608,9 @@ runpopen (char *cmd, const char *mode)
   else
     fprintf (stderr, "\nrunpopen command not allowed: %s\n", cmdname);
 
+  if (f)
+    kpse_find_file_cache_flush ();
+
   if (safecmd)
     free (safecmd);
   if (cmdname)
@@ -2154,6 +2161,8 @@ close_file_or_pipe (FILE *f)
 #ifdef WIN32
           Poptr = NULL;
 #endif
+          /* The command has finished writing whatever it writes.  */
+          kpse_find_file_cache_flush ();
         }
         pipes[i] = NULL;
         return;
@@ -2594,22 +2603,548 @@ swap_items (char *p, int nitems, int size)
 }
 #endif /* not WORDS_BIGENDIAN and not NO_DUMP_SHARE */
 
+/* True if the dump file being read or written is in the machine's own
+   byte order, rather than the usual big-endian one.  */
+static boolean fmt_native = false;
+
+#ifdef XeTeX
+/* XeTeX's formats are gzip-compressed.  If the variable fmt_native is
+   true when one is dumped, it is written uncompressed and unswapped
+   instead, after a header identifying the kind of build that wrote it;
+   loading such a format is little more than reading it into the
+   arrays.  It can only be loaded by the same kind of build, of course.
+   Both kinds of format are loaded.  */
+
+#define FMT_NATIVE_MAGIC "XeTeXfmn"
+
+typedef struct {
+  char magic[8];
+  unsigned int build;
+} fmt_native_header;
+
+/* Formats are big, so give zlib bigger buffers than its default 8k.  */
+#define FMT_GZ_BUFFER_SIZE (128 * 1024)
+
+/* If instead the variable fmt_chunked is true, the format is written as
+   a series of chunks compressed independently of each other, after the
+   magic FMT_CHUNKED_MAGIC.  Each chunk is preceded by its uncompressed
+   and compressed lengths, four bytes each and big-endian, and the last
+   one is followed by two zero lengths.  The items are swapped as in a
+   gzip-compressed format, so any build loads it.  With FMT_THREADS, the
+   chunks are compressed by several threads while TeX dumps, and read and
+   decompressed by them ahead of TeX undumping.  */
+
+#define FMT_CHUNKED_MAGIC "XeTeXfmc"
+#define FMT_CHUNK_SIZE (512 * 1024)
+#define FMT_CHUNK_SLOTS 8       /* chunks in memory at most */
+#define FMT_CHUNK_WORKERS 4     /* threads at most */
+
+#ifdef FMT_THREADS
+#include <pthread.h>
+static pthread_mutex_t fmt_chunks_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fmt_chunks_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t fmt_chunks_threads[FMT_CHUNK_WORKERS];
+/* The mutex protects the chunk states and the members of fmt_chunks
+   below that are used by the workers; the condition signals any change
+   of them.  */
+#define FMT_CHUNKS_LOCK() pthread_mutex_lock (&fmt_chunks_mutex)
+#define FMT_CHUNKS_UNLOCK() pthread_mutex_unlock (&fmt_chunks_mutex)
+#define FMT_CHUNKS_WAIT() pthread_cond_wait (&fmt_chunks_cond, &fmt_chunks_mutex)
+#define FMT_CHUNKS_SIGNAL() pthread_cond_broadcast (&fmt_chunks_cond)
+#else
+#define FMT_CHUNKS_LOCK()
+#define FMT_CHUNKS_UNLOCK()
+#define FMT_CHUNKS_WAIT()
+#define FMT_CHUNKS_SIGNAL()
+#endif
+
+/* A chunk goes from free (being filled by TeX when dumping) to full to
+   busy (being compressed) to done (waiting to be written); when loading,
+   from free to busy (being read and decompressed) to done (being
+   undumped).  */
+enum { CHUNK_FREE, CHUNK_FULL, CHUNK_BUSY, CHUNK_DONE };
+
+typedef struct {
+  int state;
+  boolean error;
+  uLongf length;                /* of the uncompressed data */
+  uLongf packed_length;
+  Bytef *data;
+  Bytef *packed;
+} fmt_chunk;
+
+static struct {
+  boolean active;               /* the format file is chunked */
+  boolean output;
+  gzFile file;
+  fmt_chunk slots[FMT_CHUNK_SLOTS];
+  int current;                  /* the slot TeX fills or undumps from */
+  uLongf offset;                /* how much of it has been undumped */
+  int next;                     /* the next slot to be written or read */
+  int pending;                  /* chunks handed over and not written yet */
+  boolean eof;                  /* the end of the chunks has been read */
+  boolean quit;                 /* the workers must return */
+  int workers;
+} fmt_chunks;
+
+static void
+fmt_chunk_put_length (Bytef *p, uLongf n)
+{
+  p[0] = (Bytef) (n >> 24);
+  p[1] = (Bytef) (n >> 16);
+  p[2] = (Bytef) (n >> 8);
+  p[3] = (Bytef) n;
+}
+
+static uLongf
+fmt_chunk_get_length (const Bytef *p)
+{
+  return (uLongf) p[0] << 24 | (uLongf) p[1] << 16 | (uLongf) p[2] << 8 | p[3];
+}
+
+/* Read the lengths and compressed data of the next chunk into C.  Return
+   false at the end of the chunks, and also on error, setting C->error.  */
+
+static boolean
+fmt_chunk_read (fmt_chunk *c)
+{
+  Bytef lengths[8];
+
+  if (gzread (fmt_chunks.file, lengths, 8) != 8)
+    {
+      c->error = true;
+      return false;
+    }
+  c->length = fmt_chunk_get_length (lengths);
+  c->packed_length = fmt_chunk_get_length (lengths + 4);
+  if (c->length == 0 && c->packed_length == 0)
+    return false;
+  if (c->length == 0 || c->length > FMT_CHUNK_SIZE
+      || c->packed_length == 0 || c->packed_length > compressBound (FMT_CHUNK_SIZE)
+      || gzread (fmt_chunks.file, c->packed, c->packed_length) != (int) c->packed_length)
+    {
+      c->error = true;
+      return false;
+    }
+  return true;
+}
+
+/* Compress or decompress the chunk C, outside the lock.  */
+
+static void
+fmt_chunk_process (fmt_chunk *c)
+{
+  if (fmt_chunks.output)
+    {
+      c->packed_length = compressBound (FMT_CHUNK_SIZE);
+      c->error = compress2 (c->packed, &c->packed_length,
+                            c->data, c->length, Z_BEST_SPEED) != Z_OK;
+    }
+  else
+    {
+      uLongf length = FMT_CHUNK_SIZE;
+      c->error = uncompress (c->data, &length, c->packed, c->packed_length) != Z_OK
+                 || length != c->length;
+    }
+}
+
+/* Return a chunk to process and mark it busy, or NULL if there is none;
+   when loading, this reads the next chunk from the file.  The lock must
+   be held.  */
+
+static fmt_chunk *
+fmt_chunk_take (void)
+{
+  fmt_chunk *c;
+  int i;
+
+  if (fmt_chunks.output)
+    {
+      for (i = 0; i < FMT_CHUNK_SLOTS; i++)
+        {
+          c = &fmt_chunks.slots[(fmt_chunks.next + i) % FMT_CHUNK_SLOTS];
+          if (c->state == CHUNK_FULL)
+            {
+              c->state = CHUNK_BUSY;
+              return c;
+            }
+        }
+      return NULL;
+    }
+
+  c = &fmt_chunks.slots[fmt_chunks.next];
+  if (fmt_chunks.eof || c->state != CHUNK_FREE)
+    return NULL;
+  if (!fmt_chunk_read (c))
+    {
+      fmt_chunks.eof = true;
+      if (c->error)
+        {
+          /* TeX finds out when it gets to this chunk.  */
+          c->state = CHUNK_DONE;
+          FMT_CHUNKS_SIGNAL ();
+        }
+      return NULL;
+    }
+  c->state = CHUNK_BUSY;
+  fmt_chunks.next = (fmt_chunks.next + 1) % FMT_CHUNK_SLOTS;
+  return c;
+}
+
+#ifdef FMT_THREADS
+static void *
+fmt_chunk_worker (void *arg)
+{
+  FMT_CHUNKS_LOCK ();
+  while (!fmt_chunks.quit)
+    {
+      fmt_chunk *c = fmt_chunk_take ();
+      if (c == NULL)
+        {
+          FMT_CHUNKS_WAIT ();
+          continue;
+        }
+      FMT_CHUNKS_UNLOCK ();
+      fmt_chunk_process (c);
+      FMT_CHUNKS_LOCK ();
+      c->state = CHUNK_DONE;
+      FMT_CHUNKS_SIGNAL ();
+    }
+  FMT_CHUNKS_UNLOCK ();
+  return arg;
+}
+#endif
+
+/* Wait until the chunk C is done, with the lock held.  Without workers,
+   do the work here.  Return false if C will never be done, because the
+   chunks being read have come to an end.  */
+
+static boolean
+fmt_chunk_wait (fmt_chunk *c)
+{
+  while (c->state != CHUNK_DONE)
+    {
+      if (!fmt_chunks.output && fmt_chunks.eof && c->state == CHUNK_FREE)
+        return false;
+      if (fmt_chunks.workers == 0)
+        {
+          fmt_chunk *d = fmt_chunk_take ();
+          if (d != NULL)
+            {
+              fmt_chunk_process (d);
+              d->state = CHUNK_DONE;
+            }
+        }
+      else
+        FMT_CHUNKS_WAIT ();
+    }
+  return true;
+}
+
+/* Allocate the chunks of FILE and start the workers.  */
+
+static void
+fmt_chunks_start (gzFile file, boolean output)
+{
+  int i;
+
+  fmt_chunks.active = true;
+  fmt_chunks.output = output;
+  fmt_chunks.file = file;
+  for (i = 0; i < FMT_CHUNK_SLOTS; i++)
+    {
+      fmt_chunk *c = &fmt_chunks.slots[i];
+      c->state = CHUNK_FREE;
+      c->error = false;
+      c->length = 0;
+      c->data = xmalloc (FMT_CHUNK_SIZE);
+      c->packed = xmalloc (compressBound (FMT_CHUNK_SIZE));
+    }
+  fmt_chunks.current = fmt_chunks.next = fmt_chunks.pending = 0;
+  fmt_chunks.offset = 0;
+  fmt_chunks.eof = fmt_chunks.quit = false;
+  fmt_chunks.workers = 0;
+#ifdef FMT_THREADS
+  {
+    long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+    int n = cpus < 1 ? 1 : cpus > FMT_CHUNK_WORKERS ? FMT_CHUNK_WORKERS : (int) cpus;
+
+    /* If no thread can be created, the work is done in TeX's thread.  */
+    while (fmt_chunks.workers < n
+           && pthread_create (&fmt_chunks_threads[fmt_chunks.workers], NULL,
+                              fmt_chunk_worker, NULL) == 0)
+      fmt_chunks.workers++;
+  }
+#endif
+}
+
+/* Write out the done chunks in order, waiting for them as long as more
+   than LIMIT are pending.  The lock must be held.  */
+
+static void
+fmt_chunks_write (int limit)
+{
+  while (fmt_chunks.pending > limit
+         || (fmt_chunks.pending > 0
+             && fmt_chunks.slots[fmt_chunks.next].state == CHUNK_DONE))
+    {
+      fmt_chunk *c = &fmt_chunks.slots[fmt_chunks.next];
+      Bytef lengths[8];
+
+      fmt_chunk_wait (c);
+      fmt_chunk_put_length (lengths, c->length);
+      fmt_chunk_put_length (lengths + 4, c->packed_length);
+      if (c->error || gzwrite (fmt_chunks.file, lengths, 8) != 8
+          || gzwrite (fmt_chunks.file, c->packed, c->packed_length) != (int) c->packed_length)
+        {
+          fprintf (stderr, "! Could not write a %lu-byte chunk to %s.\n",
+                   (unsigned long) c->length, nameoffile+1);
+          uexit (1);
+        }
+      c->length = 0;
+      c->state = CHUNK_FREE;
+      fmt_chunks.next = (fmt_chunks.next + 1) % FMT_CHUNK_SLOTS;
+      fmt_chunks.pending--;
+    }
+}
+
+/* Hand the chunk TeX has filled to the workers, and go on to the next.  */
+
+static void
+fmt_chunks_submit (void)
+{
+  FMT_CHUNKS_LOCK ();
+  fmt_chunks.slots[fmt_chunks.current].state = CHUNK_FULL;
+  fmt_chunks.pending++;
+  FMT_CHUNKS_SIGNAL ();
+  fmt_chunks.current = (fmt_chunks.current + 1) % FMT_CHUNK_SLOTS;
+  fmt_chunks_write (FMT_CHUNK_SLOTS - 1);
+  FMT_CHUNKS_UNLOCK ();
+}
+
+/* Add NITEMS items of ITEM_SIZE bytes at P to the chunks, swapped in
+   them if need be.  A chunk holds only whole items.  */
+
+static void
+fmt_chunks_dump (char *p, int item_size, int nitems)
+{
+  while (nitems > 0)
+    {
+      fmt_chunk *c = &fmt_chunks.slots[fmt_chunks.current];
+      int n = (FMT_CHUNK_SIZE - c->length) / item_size;
+
+      if (n == 0)
+        {
+          fmt_chunks_submit ();
+          continue;
+        }
+      if (n > nitems)
+        n = nitems;
+      memcpy (c->data + c->length, p, n * item_size);
+#if !defined (WORDS_BIGENDIAN) && !defined (NO_DUMP_SHARE)
+      swap_items ((char *) c->data + c->length, n, item_size);
+#endif
+      c->length += n * item_size;
+      p += n * item_size;
+      nitems -= n;
+    }
+}
+
+/* Copy the next LENGTH bytes from the chunks to P; return false if there
+   are not so many, or a chunk could not be read.  */
+
+static boolean
+fmt_chunks_undump (char *p, size_t length)
+{
+  while (length > 0)
+    {
+      fmt_chunk *c = &fmt_chunks.slots[fmt_chunks.current];
+      size_t n;
+      boolean ok;
+
+      FMT_CHUNKS_LOCK ();
+      ok = fmt_chunk_wait (c);
+      FMT_CHUNKS_UNLOCK ();
+      if (!ok || c->error)
+        return false;
+
+      n = c->length - fmt_chunks.offset;
+      if (n > length)
+        n = length;
+      memcpy (p, c->data + fmt_chunks.offset, n);
+      fmt_chunks.offset += n;
+      p += n;
+      length -= n;
+
+      if (fmt_chunks.offset == c->length)
+        {
+          FMT_CHUNKS_LOCK ();
+          c->state = CHUNK_FREE;
+          FMT_CHUNKS_SIGNAL ();
+          FMT_CHUNKS_UNLOCK ();
+          fmt_chunks.current = (fmt_chunks.current + 1) % FMT_CHUNK_SLOTS;
+          fmt_chunks.offset = 0;
+        }
+    }
+  return true;
+}
+
+/* Finish writing the chunks, stop the workers and free the chunks.  */
+
+static void
+fmt_chunks_finish (void)
+{
+  int i;
+
+  if (fmt_chunks.output)
+    {
+      Bytef end[8];
+
+      if (fmt_chunks.slots[fmt_chunks.current].length > 0)
+        fmt_chunks_submit ();
+      FMT_CHUNKS_LOCK ();
+      fmt_chunks_write (0);
+      FMT_CHUNKS_UNLOCK ();
+      memset (end, 0, 8);
+      if (gzwrite (fmt_chunks.file, end, 8) != 8)
+        {
+          fprintf (stderr, "! Could not write to %s.\n", nameoffile+1);
+          uexit (1);
+        }
+    }
+
+#ifdef FMT_THREADS
+  FMT_CHUNKS_LOCK ();
+  fmt_chunks.quit = true;
+  FMT_CHUNKS_SIGNAL ();
+  FMT_CHUNKS_UNLOCK ();
+  for (i = 0; i < fmt_chunks.workers; i++)
+    pthread_join (fmt_chunks_threads[i], NULL);
+#endif
+  fmt_chunks.workers = 0;
+
+  for (i = 0; i < FMT_CHUNK_SLOTS; i++)
+    {
+      free (fmt_chunks.slots[i].data);
+      free (fmt_chunks.slots[i].packed);
+    }
+  fmt_chunks.active = false;
+}
+
+/* Return a checksum of what the layout of a native format depends on.  */
+
+static unsigned int
+fmt_native_build (void)
+{
+  union { unsigned int u; unsigned char c[4]; } order;
+  char buf[256];
+  unsigned int h = 2166136261U;
+  const char *p;
+
+  order.u = 0x01020304;
+  sprintf (buf, "%d%d%d%d %d %d %d %d%.200s", order.c[0], order.c[1],
+           order.c[2], order.c[3], (int) sizeof (memoryword),
+           (int) sizeof (integer), (int) sizeof (glueratio),
+           (int) sizeof (void *), versionstring);
+  for (p = buf; *p; p++)
+    h = (h ^ (unsigned char) *p) * 16777619U;
+
+  return h;
+}
+
+boolean
+open_fmt_input (gzFile *f)
+{
+  FILE *file;
+  fmt_native_header header;
+  boolean chunked;
+  int fd;
+
+  if (!open_input (&file, DUMP_FORMAT, FOPEN_RBIN_MODE))
+    return false;
+
+  chunked = fread (&header, sizeof (header), 1, file) == 1;
+  fmt_native = chunked && memcmp (header.magic, FMT_NATIVE_MAGIC, 8) == 0;
+  chunked = chunked && memcmp (header.magic, FMT_CHUNKED_MAGIC, 8) == 0;
+  if (fmt_native && header.build != fmt_native_build ()) {
+    fprintf (stderr, "\n%s was dumped by a different kind of build.\n",
+             nameoffile + 1);
+    fclose (file);
+    return false;
+  }
+
+  /* gzdopen reads from the descriptor, which stdio has read ahead.  */
+  fd = fileno (file);
+  if (lseek (fd, fmt_native ? sizeof (header) : chunked ? 8 : 0, SEEK_SET) < 0) {
+    fclose (file);
+    return false;
+  }
+
+  /* gzread passes uncompressed data through, in large reads straight
+     into the arrays.  */
+  *f = gzdopen (fd, FOPEN_RBIN_MODE);
+  if (*f == NULL || gzbuffer (*f, FMT_GZ_BUFFER_SIZE) != 0)
+    return false;
+  if (chunked)
+    fmt_chunks_start (*f, false);
+  return true;
+}
+
+boolean
+open_fmt_output (gzFile *f)
+{
+  FILE *file;
+
+  fmt_native = texmf_yesno ("fmt_native");
+  if (!open_output (&file, FOPEN_WBIN_MODE))
+    return false;
+
+  if (fmt_native) {
+    fmt_native_header header;
+
+    memcpy (header.magic, FMT_NATIVE_MAGIC, 8);
+    header.build = fmt_native_build ();
+    /* `T' makes gzwrite write the data as it is.  */
+    *f = gzdopen (fileno (file), FOPEN_WBIN_MODE "T");
+    return *f != NULL && gzbuffer (*f, FMT_GZ_BUFFER_SIZE) == 0
+           && gzwrite (*f, &header, sizeof (header)) == sizeof (header);
+  }
+
+  if (texmf_yesno ("fmt_chunked")) {
+    *f = gzdopen (fileno (file), FOPEN_WBIN_MODE "T");
+    if (*f == NULL || gzbuffer (*f, FMT_GZ_BUFFER_SIZE) != 0
+        || gzwrite (*f, FMT_CHUNKED_MAGIC, 8) != 8)
+      return false;
+    fmt_chunks_start (*f, true);
+    return true;
+  }
+
+  *f = gzdopen (fileno (file), FOPEN_WBIN_MODE);
+  return *f != NULL && gzbuffer (*f, FMT_GZ_BUFFER_SIZE) == 0
+         && gzsetparams (*f, 1, Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+void
+close_fmt_file (gzFile f)
+{
+  if (fmt_chunks.active)
+    fmt_chunks_finish ();
+  gzclose (f);
+}
+#endif /* XeTeX */
+
 
 /* Here we write NITEMS items, each item being ITEM_SIZE bytes long.
    The pointer to the stuff to write is P, and we write to the file
    OUT_FILE.  */
 
-void
+static void
 #ifdef XeTeX
-do_dump (char *p, int item_size, int nitems,  gzFile out_file)
+dump_write (char *p, int item_size, int nitems,  gzFile out_file)
 #else
-do_dump (char *p, int item_size, int nitems,  FILE *out_file)
+dump_write (char *p, int item_size, int nitems,  FILE *out_file)
 #endif
 {
-#if !defined (WORDS_BIGENDIAN) && !defined (NO_DUMP_SHARE)
-  swap_items (p, nitems, item_size);
-#endif
-
 #ifdef XeTeX
   if (gzwrite (out_file, p, item_size * nitems) != item_size * nitems)
 #else
@@ -2620,12 +3155,52 @@ do_dump (char *p, int item_size, int nitems,  FILE *out_file)
                nitems, item_size, nameoffile+1);
       uexit (1);
     }
+}
+
+/* Items to be swapped are copied here first, a bufferful at a time,
+   rather than swapped in place and back again.  The size must be a
+   multiple of every item size.  */
+#define DUMP_BUFFER_SIZE 65536
+
+void
+#ifdef XeTeX
+do_dump (char *p, int item_size, int nitems,  gzFile out_file)
+#else
+do_dump (char *p, int item_size, int nitems,  FILE *out_file)
+#endif
+{
+#ifdef XeTeX
+  if (fmt_chunks.active)
+    {
+      fmt_chunks_dump (p, item_size, nitems);
+      return;
+    }
+#endif
 
-  /* Have to restore the old contents of memory, since some of it might
-     get used again.  */
 #if !defined (WORDS_BIGENDIAN) && !defined (NO_DUMP_SHARE)
-  swap_items (p, nitems, item_size);
+  if (!fmt_native && item_size > 1)
+    {
+      static char *buffer = NULL;
+      int chunk = DUMP_BUFFER_SIZE / item_size;
+
+      if (!buffer)
+        buffer = xmalloc (DUMP_BUFFER_SIZE);
+
+      while (nitems > 0)
+        {
+          int n = nitems < chunk ? nitems : chunk;
+
+          memcpy (buffer, p, n * item_size);
+          swap_items (buffer, n, item_size);
+          dump_write (buffer, item_size, n, out_file);
+          p += n * item_size;
+          nitems -= n;
+        }
+      return;
+    }
 #endif
+
+  dump_write (p, item_size, nitems, out_file);
 }
 
 
@@ -2639,7 +3214,9 @@ do_undump (char *p, int item_size, int nitems, FILE *in_file)
 #endif
 {
 #ifdef XeTeX
-  if (gzread (in_file, p, item_size * nitems) != item_size * nitems)
+  if (fmt_chunks.active
+      ? !fmt_chunks_undump (p, (size_t) item_size * nitems)
+      : gzread (in_file, p, item_size * nitems) != item_size * nitems)
 #else
   if (fread (p, item_size, nitems, in_file) != (size_t) nitems)
 #endif
@@ -2647,7 +3224,8 @@ do_undump (char *p, int item_size, int nitems, FILE *in_file)
             nitems, item_size, nameoffile+1);
 
 #if !defined (WORDS_BIGENDIAN) && !defined (NO_DUMP_SHARE)
-  swap_items (p, nitems, item_size);
+  if (!fmt_native)
+    swap_items (p, nitems, item_size);
 #endif
 }
 
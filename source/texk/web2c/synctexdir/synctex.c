@@ -415,6 +415,188 @@ static struct {
 #   define SYNCTEX_WARNING_DISABLE (synctex_ctxt.flags.warn)
 #   define SYNCTEX_fprintf (*synctex_ctxt.fprintf)
 
+/*  The records are not written with fprintf or gzprintf, whose format
+ *  parsing and per call overhead cost more than everything else SyncTeX
+ *  does.  They are formatted by hand into this buffer, the only
+ *  conversions needed being %i and %s, and the buffer goes to the file
+ *  in one piece when it is full and before the file is closed.
+ *  With SYNCTEX_WRITER_THREAD defined, a full buffer is handed to a
+ *  thread of its own, which writes (and compresses) it while TeX goes on
+ *  filling the other buffer.  */
+#   define SYNCTEX_BUFFER_SIZE 65536
+static char synctex_buffers[2][SYNCTEX_BUFFER_SIZE];
+static char *synctex_buffer = synctex_buffers[0];
+static size_t synctex_buffer_length = 0;
+
+/*  Write len bytes to file, a gzFile unless no_gz, return 0 on success.  */
+static int synctex_write(void *file, int no_gz, const char *data, size_t len)
+{
+    if (no_gz) {
+        return fwrite(data, 1, len, (FILE *) file) == len ? 0 : -1;
+    }
+    return gzwrite((gzFile) file, data, (unsigned) len) == (int) len ? 0 : -1;
+}
+
+#   if defined(SYNCTEX_WRITER_THREAD)
+#   include <pthread.h>
+
+static struct {
+    pthread_t thread;
+    void *file;                 /*  SYNCTEX_FILE and SYNCTEX_NO_GZ, fixed while running */
+    int no_gz;
+    pthread_mutex_t mutex;      /*  protects the members below */
+    pthread_cond_t cond;        /*  signals any change of them */
+    int running;                /*  the thread has been started and not joined yet */
+    int quit;                   /*  the thread must return once data is written */
+    const char *data;           /*  the buffer handed to the thread, NULL when it is idle */
+    size_t length;
+    int error;                  /*  a write failed */
+} synctex_writer = {
+    0, NULL, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, NULL, 0, 0};
+
+static void *synctex_writer_main(void *arg __attribute__ ((unused)))
+{
+    pthread_mutex_lock(&synctex_writer.mutex);
+    for (;;) {
+        const char *data;
+        int error;
+        while (NULL == synctex_writer.data && !synctex_writer.quit) {
+            pthread_cond_wait(&synctex_writer.cond, &synctex_writer.mutex);
+        }
+        if (NULL == (data = synctex_writer.data)) {
+            break;
+        }
+        pthread_mutex_unlock(&synctex_writer.mutex);
+        error = synctex_write(synctex_writer.file, synctex_writer.no_gz,
+                              data, synctex_writer.length);
+        pthread_mutex_lock(&synctex_writer.mutex);
+        if (error) {
+            synctex_writer.error = 1;
+        }
+        synctex_writer.data = NULL;
+        pthread_cond_broadcast(&synctex_writer.cond);
+    }
+    pthread_mutex_unlock(&synctex_writer.mutex);
+    return NULL;
+}
+
+/*  Start the writer once the file is open; if that fails, synctex_flush
+ *  simply writes the buffers itself.  */
+static void synctex_writer_start(void)
+{
+    synctex_writer.file = SYNCTEX_FILE;
+    synctex_writer.no_gz = SYNCTEX_NO_GZ;
+    synctex_writer.quit = 0;
+    synctex_writer.data = NULL;
+    synctex_writer.error = 0;
+    synctex_writer.running =
+        0 == pthread_create(&synctex_writer.thread, NULL, &synctex_writer_main, NULL);
+}
+
+/*  Let the writer finish with the buffer it was given and join it, before
+ *  the file is closed.  Return 0 if all its writes succeeded.  */
+static int synctex_writer_join(void)
+{
+    if (!synctex_writer.running) {
+        return 0;
+    }
+    pthread_mutex_lock(&synctex_writer.mutex);
+    synctex_writer.quit = 1;
+    pthread_cond_broadcast(&synctex_writer.cond);
+    pthread_mutex_unlock(&synctex_writer.mutex);
+    pthread_join(synctex_writer.thread, NULL);
+    synctex_writer.running = 0;
+    return synctex_writer.error ? -1 : 0;
+}
+#   else
+static void synctex_writer_start(void)
+{
+}
+
+static int synctex_writer_join(void)
+{
+    return 0;
+}
+#   endif
+
+/*  Write the buffer to the file, or hand it to the writer, return 0 on
+ *  success (as far as known yet).  */
+static int synctex_flush(void)
+{
+    size_t len = synctex_buffer_length;
+    synctex_buffer_length = 0;
+    if (0 == len || NULL == SYNCTEX_FILE) {
+        return 0;
+    }
+#   if defined(SYNCTEX_WRITER_THREAD)
+    if (synctex_writer.running) {
+        int error;
+        pthread_mutex_lock(&synctex_writer.mutex);
+        while (NULL != synctex_writer.data) {
+            pthread_cond_wait(&synctex_writer.cond, &synctex_writer.mutex);
+        }
+        synctex_writer.data = synctex_buffer;
+        synctex_writer.length = len;
+        error = synctex_writer.error;
+        pthread_cond_broadcast(&synctex_writer.cond);
+        pthread_mutex_unlock(&synctex_writer.mutex);
+        synctex_buffer = synctex_buffer == synctex_buffers[0] ? synctex_buffers[1] : synctex_buffers[0];
+        return error ? -1 : 0;
+    }
+#   endif
+    return synctex_write(SYNCTEX_FILE, SYNCTEX_NO_GZ, synctex_buffer, len);
+}
+
+#   define SYNCTEX_PUTC(c) do { \
+    if (synctex_buffer_length == SYNCTEX_BUFFER_SIZE && synctex_flush()) { \
+        len = 0; \
+        goto done; \
+    } \
+    synctex_buffer[synctex_buffer_length++] = (c); \
+    ++len; \
+} while (0)
+
+/*  A replacement for fprintf, returning the number of characters
+ *  written, 0 on error.  */
+static int synctex_buffered_printf(void *file __attribute__ ((unused)), const char *format, ...)
+{
+    va_list args;
+    int len = 0;
+    va_start(args, format);
+    for (; *format; ++format) {
+        if ('%' != *format) {
+            SYNCTEX_PUTC(*format);
+        } else if ('i' == *++format) {
+            int i = va_arg(args, int);
+            unsigned int u = i < 0 ? 0u - (unsigned int) i : (unsigned int) i;
+            char digits[3 * sizeof(int)];
+            int n = 0;
+            do {
+                digits[n++] = (char) ('0' + u % 10);
+                u /= 10;
+            } while (u);
+            if (i < 0) {
+                SYNCTEX_PUTC('-');
+            }
+            while (n) {
+                SYNCTEX_PUTC(digits[--n]);
+            }
+        } else if ('s' == *format) {
+            const char *str = va_arg(args, const char *);
+            while (*str) {
+                SYNCTEX_PUTC(*str++);
+            }
+        } else {
+            /*  No other conversion is used.  */
+            len = 0;
+            goto done;
+        }
+    }
+done:
+    va_end(args);
+    return len;
+}
+
 /*  Initialize the options, synchronize the variables.
  *  This is sent by *tex.web before any TeX macro is used.
  *  */
@@ -453,7 +635,9 @@ void synctexabort(boolean log_opened __attribute__ ((unused)))
 #   if SYNCTEX_DEBUG
     printf("\nSynchronize DEBUG: synctex_abort\n");
 #   endif
+    synctex_buffer_length = 0;
     if (SYNCTEX_FILE) {
+        synctex_writer_join();
         if (SYNCTEX_NO_GZ) {
             xfclose((FILE *) SYNCTEX_FILE, synctex_ctxt.busy_name);
         } else {
@@ -627,15 +811,16 @@ static void *synctex_dot_open(void)
             strcat(the_busy_name, synctex_suffix_busy);
             if (SYNCTEX_NO_GZ) {
                 SYNCTEX_FILE = fopen(the_busy_name, FOPEN_W_MODE);
-                synctex_ctxt.fprintf = (synctex_fprintf_t) (&fprintf);
             } else {
                 SYNCTEX_FILE = gzopen(the_busy_name, FOPEN_WBIN_MODE);
-                synctex_ctxt.fprintf = (synctex_fprintf_t) (&gzprintf);
             }
+            synctex_ctxt.fprintf = &synctex_buffered_printf;
+            synctex_buffer_length = 0;
 #   if SYNCTEX_DEBUG
             printf("\nwarning: Synchronize DEBUG: synctex_dot_open 2\n");
 #   endif
             if (SYNCTEX_FILE) {
+                synctex_writer_start();
                 if (SYNCTEX_NO_ERROR == synctex_record_preamble()) {
                     /*  Initialization of the context */
                     synctex_ctxt.magnification = 1000;
@@ -833,6 +1018,10 @@ void synctexterminate(boolean log_opened)
         if (SYNCTEX_FILE) {
             if (SYNCTEX_NOT_VOID) {
                 synctex_record_postamble();
+                if (synctex_flush() | synctex_writer_join()) {
+                    fprintf(stderr, "SyncTeX: Can't write %s\n",
+                            synctex_ctxt.busy_name);
+                }
                 /* close the synctex file */
                 if (SYNCTEX_NO_GZ) {
                     xfclose((FILE *) SYNCTEX_FILE, synctex_ctxt.busy_name);
@@ -869,6 +1058,7 @@ void synctexterminate(boolean log_opened)
                 }
             } else {
                 /* close and remove the synctex file because there are no pages of output */
+                synctex_writer_join();
                 if (SYNCTEX_NO_GZ) {
                     xfclose((FILE *) SYNCTEX_FILE, synctex_ctxt.busy_name);
                 } else {
@@ -918,6 +1108,7 @@ void synctexterminate(boolean log_opened)
         remove(the_real_syncname);
         if (SYNCTEX_FILE) {
             /* close the synctex file */
+            synctex_writer_join();
             if (SYNCTEX_NO_GZ) {
                 xfclose((FILE *) SYNCTEX_FILE, synctex_ctxt.busy_name);
             } else {
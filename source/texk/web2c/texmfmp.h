@@ -257,14 +257,10 @@ extern void topenin (void);
 #define bopenout(f)	open_output (&(f), FOPEN_WBIN_MODE)
 #define bclose		aclose
 #ifdef XeTeX
-/* f is declared as gzFile, but we temporarily use it for a FILE *
-   so that we can use the standard open calls */
-#define wopenin(f)	(open_input ((FILE**)&(f), DUMP_FORMAT, FOPEN_RBIN_MODE) \
-						&& (f = gzdopen(fileno((FILE*)f), FOPEN_RBIN_MODE)))
-#define wopenout(f)	(open_output ((FILE**)&(f), FOPEN_WBIN_MODE) \
-						&& (f = gzdopen(fileno((FILE*)f), FOPEN_WBIN_MODE)) \
-						&& (gzsetparams(f, 1, Z_DEFAULT_STRATEGY) == Z_OK))
-#define wclose(f)	gzclose(f)
+/* Dump files are gzFiles, which may be uncompressed; see texmfmp.c.  */
+#define wopenin(f)	open_fmt_input (&(f))
+#define wopenout(f)	open_fmt_output (&(f))
+#define wclose(f)	close_fmt_file(f)
 #else
 #define wopenin(f)	open_input (&(f), DUMP_FORMAT, FOPEN_RBIN_MODE)
 #define wopenout	bopenout
@@ -350,6 +346,9 @@ extern void paintrow (/*screenrow, pixelcolor, transspec, screencol*/);
 /* We define the routines to do the actual work in texmfmp.c.  */
 #ifdef XeTeX
 #include <zlib.h>
+extern boolean open_fmt_input (gzFile *);
+extern boolean open_fmt_output (gzFile *);
+extern void close_fmt_file (gzFile);
 extern void do_dump (char *, int, int, gzFile);
 extern void do_undump (char *, int, int, gzFile);
 #else
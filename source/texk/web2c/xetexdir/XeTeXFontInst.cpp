@@ -45,15 +45,80 @@ authorization from the copyright holders.
 #include "XeTeXFontInst.h"
 #include "XeTeXLayoutInterface.h"
 #include "XeTeX_ext.h"
+#include "XeTeXOTMath.h"
 
 #include <string.h>
 #include FT_GLYPH_H
 #include FT_ADVANCES_H
 
+#include <list>
+#include <map>
+#include <string>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 FT_Library gFreeTypeLibrary = 0;
 
 static hb_font_funcs_t* hbFontFuncs = NULL;
 
+/* The FreeType face, the HarfBuzz face (and with it the parsed layout tables)
+   and the MATH table of a font file are the same at every size, so they are
+   shared by all instances using the same file and face index. Nothing here
+   depends on the size, as all metrics are read unscaled. */
+struct XeTeXFontFace
+{
+    std::pair<std::string, int> key;
+    int refCount;
+    FT_Face ftFace;
+    hb_face_t* hbFace;
+    hb_blob_t* fileBlob;    // the mapped font file, if it is a plain sfnt
+    unsigned int sfntOffset; // offset of this face's table directory in it
+    std::map<OTTag, hb_blob_t*> tables; // tables handed out by getFontTable
+    OTMathTable* mathTable; // parsed MATH table, once asked for
+    bool mathTableRead;
+};
+
+typedef std::map<std::pair<std::string, int>, XeTeXFontFace*> FontFaceMap;
+
+static FontFaceMap sFontFaces;
+
+/* Faces no longer used by any instance are kept for a while, as a font is
+   often opened just to read its design size and then immediately reopened
+   at the size actually wanted. */
+#define RELEASED_FACES_KEPT 4
+static std::list<XeTeXFontFace*> sReleasedFaces;
+
+static void
+destroyFontFace(XeTeXFontFace* face)
+{
+    sFontFaces.erase(face->key);
+    for (std::map<OTTag, hb_blob_t*>::iterator i = face->tables.begin(); i != face->tables.end(); ++i)
+        hb_blob_destroy(i->second);
+    hb_face_destroy(face->hbFace);
+    FT_Done_Face(face->ftFace);
+    hb_blob_destroy(face->fileBlob);
+    delete face->mathTable;
+    delete face;
+}
+
+static void
+releaseFontFace(XeTeXFontFace* face)
+{
+    if (--face->refCount > 0)
+        return;
+
+    sReleasedFaces.push_front(face);
+    if (sReleasedFaces.size() > RELEASED_FACES_KEPT) {
+        destroyFontFace(sReleasedFaces.back());
+        sReleasedFaces.pop_back();
+    }
+}
+
 XeTeXFontInst::XeTeXFontInst(const char* pathname, int index, float pointSize, int &status)
     : m_unitsPerEM(0)
     , m_pointSize(pointSize)
@@ -65,9 +130,9 @@ XeTeXFontInst::XeTeXFontInst(const char* pathname, int index, float pointSize, i
     , m_vertical(false)
     , m_filename(NULL)
     , m_index(0)
+    , m_face(NULL)
     , m_ftFace(0)
     , m_hbFont(NULL)
-    , m_math(NULL)
 {
     if (pathname != NULL)
         initialize(pathname, index, status);
@@ -75,13 +140,13 @@ XeTeXFontInst::XeTeXFontInst(const char* pathname, int index, float pointSize, i
 
 XeTeXFontInst::~XeTeXFontInst()
 {
-    if (m_ftFace != 0) {
-        FT_Done_Face(m_ftFace);
+    hb_font_destroy(m_hbFont);
+    if (m_face != NULL) {
+        releaseFontFace(m_face);
+        m_face = NULL;
         m_ftFace = 0;
     }
-    hb_font_destroy(m_hbFont);
     delete[] m_filename;
-    free(m_math);
 }
 
 /* HarfBuzz font functions */
@@ -260,15 +325,114 @@ _get_font_funcs(void)
     return funcs;
 }
 
+static inline uint32_t
+_read_uint32(const char* p)
+{
+    const unsigned char* q = (const unsigned char*) p;
+    return ((uint32_t) q[0] << 24) | ((uint32_t) q[1] << 16) | ((uint32_t) q[2] << 8) | q[3];
+}
+
+static inline uint16_t
+_read_uint16(const char* p)
+{
+    const unsigned char* q = (const unsigned char*) p;
+    return (q[0] << 8) | q[1];
+}
+
+#ifndef WIN32
+struct MappedFile
+{
+    void* data;
+    size_t length;
+};
+
+static void
+_unmap_file(void *user_data)
+{
+    MappedFile* file = (MappedFile*) user_data;
+    munmap(file->data, file->length);
+    delete file;
+}
+#endif
+
+/* Map the font file read-only if it is an uncompressed sfnt (or collection),
+   so that tables can be handed out without copying them; returns NULL for
+   anything else (WOFF, Type 1, ...), which then goes through FreeType. */
+static hb_blob_t*
+_map_sfnt_file(const char* pathname, int index, unsigned int* sfntOffset)
+{
+#ifdef WIN32
+    return NULL;
+#else
+    struct stat st;
+    int fd = open(pathname, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0 || st.st_size < 12 || (off_t)(unsigned int) st.st_size != st.st_size) {
+        close(fd);
+        return NULL;
+    }
+    unsigned int length = st.st_size;
+    void* data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+
+    const char* base = (const char*) data;
+    uint32_t offset = 0;
+    uint32_t tag = _read_uint32(base);
+    if (tag == HB_TAG('t','t','c','f')) {
+        if (index < 0 || (uint32_t) index >= _read_uint32(base + 8)
+            || 12 + 4 * (uint64_t) index + 4 > length)
+            tag = 0;
+        else {
+            offset = _read_uint32(base + 12 + 4 * index);
+            tag = offset + 12 <= length ? _read_uint32(base + offset) : 0;
+        }
+    } else if (index != 0)
+        tag = 0;
+
+    if ((tag != 0x00010000 && tag != HB_TAG('O','T','T','O') && tag != HB_TAG('t','r','u','e'))
+        || offset + 12 + 16 * (uint64_t) _read_uint16(base + offset + 4) > length) {
+        munmap(data, length);
+        return NULL;
+    }
+
+    *sfntOffset = offset;
+    MappedFile* file = new MappedFile;
+    file->data = data;
+    file->length = length;
+    return hb_blob_create(base, length, HB_MEMORY_MODE_READONLY, file, _unmap_file);
+#endif
+}
+
 static hb_blob_t *
 _get_table(hb_face_t *, hb_tag_t tag, void *user_data)
 {
-    FT_Face face = (FT_Face) user_data;
+    XeTeXFontFace* fontFace = (XeTeXFontFace*) user_data;
+    FT_Face face = fontFace->ftFace;
     FT_ULong length = 0;
     FT_Byte *table;
     FT_Error error;
     hb_blob_t* blob = NULL;
 
+    if (fontFace->fileBlob != NULL) {
+        unsigned int fileLength;
+        const char* sfnt = hb_blob_get_data(fontFace->fileBlob, &fileLength) + fontFace->sfntOffset;
+        unsigned int numTables = _read_uint16(sfnt + 4);
+        for (unsigned int i = 0; i < numTables; ++i) {
+            const char* record = sfnt + 12 + 16 * i;
+            if (_read_uint32(record) == tag) {
+                uint32_t offset = _read_uint32(record + 8);
+                uint32_t tableLength = _read_uint32(record + 12);
+                if (offset <= fileLength && tableLength <= fileLength - offset)
+                    return hb_blob_create_sub_blob(fontFace->fileBlob, offset, tableLength);
+                break;
+            }
+        }
+        return NULL;
+    }
+
     error = FT_Load_Sfnt_Table(face, tag, 0, NULL, &length);
     if (!error) {
         table = (FT_Byte *) xmalloc(length * sizeof(char));
@@ -285,13 +449,20 @@ _get_table(hb_face_t *, hb_tag_t tag, void *user_data)
     return blob;
 }
 
-void
-XeTeXFontInst::initialize(const char* pathname, int index, int &status)
+static XeTeXFontFace*
+acquireFontFace(const char* pathname, int index)
 {
-    TT_Postscript *postTable;
-    TT_OS2* os2Table;
     FT_Error error;
-    hb_face_t *hbFace;
+    FT_Face ftFace;
+    std::pair<std::string, int> key(pathname, index);
+
+    FontFaceMap::iterator i = sFontFaces.find(key);
+    if (i != sFontFaces.end()) {
+        XeTeXFontFace* face = i->second;
+        if (face->refCount++ == 0)
+            sReleasedFaces.remove(face);
+        return face;
+    }
 
     if (!gFreeTypeLibrary) {
         error = FT_Init_FreeType(&gFreeTypeLibrary);
@@ -301,19 +472,27 @@ XeTeXFontInst::initialize(const char* pathname, int index, int &status)
         }
     }
 
-    error = FT_New_Face(gFreeTypeLibrary, pathname, index, &m_ftFace);
+    unsigned int sfntOffset = 0;
+    hb_blob_t* fileBlob = _map_sfnt_file(pathname, index, &sfntOffset);
+    if (fileBlob != NULL) {
+        unsigned int length;
+        const char* data = hb_blob_get_data(fileBlob, &length);
+        error = FT_New_Memory_Face(gFreeTypeLibrary, (const FT_Byte*) data, length, index, &ftFace);
+    } else
+        error = FT_New_Face(gFreeTypeLibrary, pathname, index, &ftFace);
     if (error) {
-        status = 1;
-        return;
+        hb_blob_destroy(fileBlob);
+        return NULL;
     }
 
-    if (!FT_IS_SCALABLE(m_ftFace)) {
-        status = 1;
-        return;
+    if (!FT_IS_SCALABLE(ftFace)) {
+        FT_Done_Face(ftFace);
+        hb_blob_destroy(fileBlob);
+        return NULL;
     }
 
     /* for non-sfnt-packaged fonts (presumably Type 1), see if there is an AFM file we can attach */
-    if (index == 0 && !FT_IS_SFNT(m_ftFace)) {
+    if (index == 0 && !FT_IS_SFNT(ftFace)) {
         char* afm = xstrdup (xbasename (pathname));
         char* p = strrchr (afm, '.');
         if (p != NULL && strlen(p) == 4 && tolower(*(p+1)) == 'p' &&
@@ -322,11 +501,40 @@ XeTeXFontInst::initialize(const char* pathname, int index, int &status)
         char *fullafm = kpse_find_file (afm, kpse_afm_format, 0);
         free (afm);
         if (fullafm) {
-            FT_Attach_File(m_ftFace, fullafm);
+            FT_Attach_File(ftFace, fullafm);
             free (fullafm);
         }
     }
 
+    XeTeXFontFace* face = new XeTeXFontFace;
+    face->key = key;
+    face->refCount = 1;
+    face->ftFace = ftFace;
+    face->fileBlob = fileBlob;
+    face->sfntOffset = sfntOffset;
+    face->mathTable = NULL;
+    face->mathTableRead = false;
+    face->hbFace = hb_face_create_for_tables(_get_table, face, NULL);
+    hb_face_set_index(face->hbFace, index);
+    hb_face_set_upem(face->hbFace, ftFace->units_per_EM);
+
+    sFontFaces[key] = face;
+    return face;
+}
+
+void
+XeTeXFontInst::initialize(const char* pathname, int index, int &status)
+{
+    TT_Postscript *postTable;
+    TT_OS2* os2Table;
+
+    m_face = acquireFontFace(pathname, index);
+    if (m_face == NULL) {
+        status = 1;
+        return;
+    }
+    m_ftFace = m_face->ftFace;
+
     m_filename = xstrdup(pathname);
     m_index = index;
     m_unitsPerEM = m_ftFace->units_per_EM;
@@ -345,11 +553,7 @@ XeTeXFontInst::initialize(const char* pathname, int index, int &status)
     }
 
     // Set up HarfBuzz font
-    hbFace = hb_face_create_for_tables(_get_table, m_ftFace, NULL);
-    hb_face_set_index(hbFace, index);
-    hb_face_set_upem(hbFace, m_unitsPerEM);
-    m_hbFont = hb_font_create(hbFace);
-    hb_face_destroy(hbFace);
+    m_hbFont = hb_font_create(m_face->hbFace);
 
     if (hbFontFuncs == NULL)
         hbFontFuncs = _get_font_funcs();
@@ -368,32 +572,43 @@ XeTeXFontInst::setLayoutDirVertical(bool vertical)
     m_vertical = vertical;
 }
 
-void *
+const void *
 XeTeXFontInst::getFontTable(OTTag tag) const
 {
-    FT_ULong tmpLength = 0;
-    FT_Error error = FT_Load_Sfnt_Table(m_ftFace, tag, 0, NULL, &tmpLength);
-    if (error)
-        return NULL;
-
-    void* table = xmalloc(tmpLength * sizeof(char));
-    if (table != NULL) {
-        error = FT_Load_Sfnt_Table(m_ftFace, tag, 0, (FT_Byte*)table, &tmpLength);
-        if (error) {
-            free((void *) table);
-            return NULL;
-        }
+    /* the table stays valid as long as the face; for a mapped font file
+       this is just a pointer into the file */
+    hb_blob_t* blob;
+    std::map<OTTag, hb_blob_t*>::iterator i = m_face->tables.find(tag);
+    if (i != m_face->tables.end())
+        blob = i->second;
+    else {
+        blob = hb_face_reference_table(m_face->hbFace, tag);
+        m_face->tables[tag] = blob;
     }
 
-    return table;
+    unsigned int length;
+    const char* table = hb_blob_get_data(blob, &length);
+    return length > 0 ? table : NULL;
 }
 
-char *
+const char *
 XeTeXFontInst::getMathTable()
 {
-    if (m_math == NULL)
-        m_math = (char*) getFontTable(MATH_TAG);
-    return m_math;
+    return (const char*) getFontTable(MATH_TAG);
+}
+
+const OTMathTable *
+XeTeXFontInst::getOTMathTable()
+{
+    if (m_face == NULL)
+        return NULL;
+    if (!m_face->mathTableRead) {
+        const char* table = getMathTable();
+        if (table != NULL)
+            m_face->mathTable = new OTMathTable(table);
+        m_face->mathTableRead = true;
+    }
+    return m_face->mathTable;
 }
 
 void *
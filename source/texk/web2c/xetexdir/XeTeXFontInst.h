@@ -52,6 +52,10 @@ authorization from the copyright holders.
 
 #define MATH_TAG HB_TAG('M','A','T','H')
 
+// font file data shared by all instances (sizes) of the same face
+struct XeTeXFontFace;
+class OTMathTable;
+
 // create specific subclasses for each supported platform
 
 class XeTeXFontInst
@@ -70,9 +74,9 @@ protected:
     char *m_filename; // font filename
     uint32_t m_index; // face index
 
-    FT_Face m_ftFace;
+    XeTeXFontFace* m_face;
+    FT_Face m_ftFace; // owned by m_face
     hb_font_t* m_hbFont;
-    char *m_math;
 
 public:
     XeTeXFontInst(float pointSize, int &status);
@@ -82,9 +86,10 @@ public:
 
     void initialize(const char* pathname, int index, int &status);
 
-    void *getFontTable(OTTag tableTag) const;
+    const void *getFontTable(OTTag tableTag) const;
     void *getFontTable(FT_Sfnt_Tag tableTag) const;
-    char *getMathTable();
+    const char *getMathTable();
+    const OTMathTable *getOTMathTable();
 
     const char *getFilename(uint32_t* index) const
     {
@@ -92,6 +97,7 @@ public:
         return m_filename;
     }
     hb_font_t *getHbFont() const { return m_hbFont; }
+    bool hasKerning() const { return FT_HAS_KERNING(m_ftFace); }
     void setLayoutDirVertical(bool vertical);
     bool getLayoutDirVertical() const { return m_vertical; };
 
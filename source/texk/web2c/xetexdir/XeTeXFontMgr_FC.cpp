@@ -31,6 +31,7 @@ authorization from the copyright holders.
 \****************************************************************************/
 
 #include <w2c/config.h>
+#include <kpathsea/kpathsea.h>
 
 #include "XeTeXFontMgr_FC.h"
 
@@ -44,6 +45,13 @@ authorization from the copyright holders.
 
 #include <unicode/ucnv.h>
 
+#include <sys/stat.h>
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 #define kFontFamilyName 1
 #define kFontStyleName  2
 #define kFontFullName   4
@@ -82,6 +90,22 @@ convertToUtf8(UConverter* conv, const unsigned char* name, int len)
 
 XeTeXFontMgr::NameCollection*
 XeTeXFontMgr_FC::readNames(FcPattern* pat)
+{
+    IndexEntry* entry = getIndexEntry(pat);
+    if (entry != NULL && entry->hasNames)
+        return new NameCollection(entry->names);
+
+    NameCollection* names = readNamesFromFont(pat);
+    if (entry != NULL) {
+        entry->names = *names;
+        entry->hasNames = true;
+        m_indexChanged = true;
+    }
+    return names;
+}
+
+XeTeXFontMgr::NameCollection*
+XeTeXFontMgr_FC::readNamesFromFont(FcPattern* pat)
 {
     NameCollection* names = new NameCollection;
 
@@ -189,6 +213,18 @@ XeTeXFontMgr_FC::readNames(FcPattern* pat)
 void
 XeTeXFontMgr_FC::getOpSizeRecAndStyleFlags(Font* theFont)
 {
+    IndexEntry* entry = getIndexEntry(theFont->fontRef);
+    if (entry != NULL && entry->hasStyle) {
+        theFont->opSizeInfo = entry->opSizeInfo;
+        theFont->weight = entry->weight;
+        theFont->width = entry->width;
+        theFont->slant = entry->slant;
+        theFont->isReg = entry->isReg;
+        theFont->isBold = entry->isBold;
+        theFont->isItalic = entry->isItalic;
+        return;
+    }
+
     XeTeXFontMgr::getOpSizeRecAndStyleFlags(theFont);
 
     if (theFont->weight == 0 && theFont->width == 0) {
@@ -202,6 +238,345 @@ XeTeXFontMgr_FC::getOpSizeRecAndStyleFlags(Font* theFont)
         if (FcPatternGetInteger(pat, FC_SLANT, 0, &value) == FcResultMatch)
             theFont->slant = value;
     }
+
+    if (entry != NULL) {
+        entry->opSizeInfo = theFont->opSizeInfo;
+        entry->weight = theFont->weight;
+        entry->width = theFont->width;
+        entry->slant = theFont->slant;
+        entry->isReg = theFont->isReg;
+        entry->isBold = theFont->isBold;
+        entry->isItalic = theFont->isItalic;
+        entry->hasStyle = true;
+        m_indexChanged = true;
+    }
+}
+
+/* If the texmf.cnf variable xetex_font_index is true, the font index file
+   in $TEXMFVAR holds, for each font file and face index looked at so far,
+   the names and style information that would otherwise be read by opening
+   the font with FreeType. It is only trusted for fonts whose directory has
+   the same modification time as when the entry was made, as installing or
+   removing fonts updates that, and whose file still has the same size and
+   modification time, in case it was rewritten in place.
+
+   Layout (native byte order, checked through the header):
+     "XeTeXfnt", uint32 version, uint32 byte order mark 0x01020304,
+     uint32 number of directories, uint32 number of fonts,
+     directories: string path, int64 mtime
+     fonts: string path, uint32 face index, int64 size, int64 mtime,
+       uint8 flags (1 = names, 2 = style),
+       [names: string PS name, then three lists (family, style, full) of
+        uint32 count and strings]
+       [style: 5 x uint32 opsize info, uint16 weight, uint16 width,
+        int16 slant, uint8 isReg, isBold, isItalic]
+   where a string is a uint32 length followed by that many bytes. */
+
+#define FONT_INDEX_MAGIC    "XeTeXfnt"
+#define FONT_INDEX_VERSION  2
+#define FONT_INDEX_BOM      0x01020304
+#define FONT_INDEX_NAME     "xetex-fontindex.dat"
+
+static int64_t
+dirModTime(const std::string& dir)
+{
+    struct stat st;
+    if (stat(dir.c_str(), &st) != 0)
+        return -1;
+    return st.st_mtime;
+}
+
+static void
+fileStamp(const std::string& path, int64_t& size, int64_t& mtime)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        size = mtime = -1;
+    else {
+        size = st.st_size;
+        mtime = st.st_mtime;
+    }
+}
+
+static std::string
+dirOf(const std::string& path)
+{
+    std::string::size_type slash = path.find_last_of("/");
+#ifdef WIN32
+    std::string::size_type bslash = path.find_last_of("\\");
+    if (bslash != std::string::npos && (slash == std::string::npos || bslash > slash))
+        slash = bslash;
+#endif
+    if (slash == std::string::npos)
+        return ".";
+    return path.substr(0, slash);
+}
+
+class IndexWriter {
+public:
+    std::string data;
+
+    void put(const void* p, size_t n) { data.append((const char*) p, n); }
+    void putU8(uint8_t v) { put(&v, 1); }
+    void putU16(uint16_t v) { put(&v, 2); }
+    void putU32(uint32_t v) { put(&v, 4); }
+    void putI64(int64_t v) { put(&v, 8); }
+    void putString(const std::string& s) { putU32(s.length()); put(s.data(), s.length()); }
+    void putList(const std::list<std::string>& l)
+    {
+        putU32(l.size());
+        for (std::list<std::string>::const_iterator i = l.begin(); i != l.end(); ++i)
+            putString(*i);
+    }
+};
+
+class IndexReader {
+public:
+    IndexReader(const char* data, size_t size) : p(data), end(data + size), ok(true) { }
+
+    const char* p;
+    const char* end;
+    bool ok;
+
+    bool get(void* v, size_t n)
+    {
+        if (!ok || (size_t)(end - p) < n)
+            return ok = false;
+        memcpy(v, p, n);
+        p += n;
+        return true;
+    }
+    uint8_t getU8() { uint8_t v = 0; get(&v, 1); return v; }
+    uint16_t getU16() { uint16_t v = 0; get(&v, 2); return v; }
+    uint32_t getU32() { uint32_t v = 0; get(&v, 4); return v; }
+    int64_t getI64() { int64_t v = 0; get(&v, 8); return v; }
+    std::string getString()
+    {
+        uint32_t n = getU32();
+        if (!ok || (size_t)(end - p) < n) {
+            ok = false;
+            return std::string();
+        }
+        std::string s(p, n);
+        p += n;
+        return s;
+    }
+    void getList(std::list<std::string>& l)
+    {
+        uint32_t n = getU32();
+        for (uint32_t i = 0; ok && i < n; ++i)
+            l.push_back(getString());
+    }
+};
+
+XeTeXFontMgr_FC::IndexEntry*
+XeTeXFontMgr_FC::getIndexEntry(FcPattern* pat)
+{
+    char* pathname;
+    int index;
+    if (m_indexFile.empty()
+        || FcPatternGetString(pat, FC_FILE, 0, (FcChar8**)&pathname) != FcResultMatch
+        || FcPatternGetInteger(pat, FC_INDEX, 0, &index) != FcResultMatch)
+        return NULL;
+
+    std::pair<std::string,int> key(pathname, index);
+    FontIndex::iterator i = m_fontIndex.find(key);
+    if (i != m_fontIndex.end()) {
+        IndexEntry& entry = i->second;
+        if (!entry.checked) {
+            int64_t size, mtime;
+            fileStamp(key.first, size, mtime);
+            if (size < 0 || size != entry.size || mtime != entry.mtime) {
+                entry = IndexEntry();
+                entry.size = size;
+                entry.mtime = mtime;
+                m_indexChanged = true;
+            }
+            entry.checked = true;
+        }
+        return &entry;
+    }
+
+    noteFontDir(key.first);
+    IndexEntry& entry = m_fontIndex[key];
+    fileStamp(key.first, entry.size, entry.mtime);
+    entry.checked = true;
+    return &entry;
+}
+
+void
+XeTeXFontMgr_FC::noteFontDir(const std::string& path)
+{
+    std::string dir = dirOf(path);
+    if (m_dirTimes.find(dir) == m_dirTimes.end())
+        m_dirTimes[dir] = dirModTime(dir);
+}
+
+void
+XeTeXFontMgr_FC::loadFontIndex()
+{
+    m_indexChanged = false;
+
+    char* var = kpse_var_value("xetex_font_index");
+    bool wanted = var != NULL && (*var == 't' || *var == 'y' || *var == '1');
+    free(var);
+    if (!wanted)
+        return;
+
+    var = kpse_var_value("TEXMFVAR");
+    if (var == NULL)
+        return;
+    m_indexFile = std::string(var) + "/" + FONT_INDEX_NAME;
+    free(var);
+
+    FILE* f = fopen(m_indexFile.c_str(), FOPEN_RBIN_MODE);
+    if (f == NULL)
+        return;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    if (size <= 0) {
+        fclose(f);
+        return;
+    }
+
+#ifndef WIN32
+    void* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    fclose(f);
+    if (mapped == MAP_FAILED)
+        return;
+    const char* data = (const char*) mapped;
+#else
+    char* data = (char*) xmalloc(size);
+    fseek(f, 0, SEEK_SET);
+    if (fread(data, 1, size, f) != (size_t) size)
+        size = 0;
+    fclose(f);
+#endif
+
+    IndexReader in(data, size);
+    char magic[8];
+    in.get(magic, sizeof(magic));
+    if (in.ok && memcmp(magic, FONT_INDEX_MAGIC, sizeof(magic)) == 0
+        && in.getU32() == FONT_INDEX_VERSION && in.getU32() == FONT_INDEX_BOM) {
+        uint32_t dirCount = in.getU32();
+        uint32_t fontCount = in.getU32();
+
+        std::map<std::string,int64_t> current;
+        for (uint32_t i = 0; in.ok && i < dirCount; ++i) {
+            std::string dir = in.getString();
+            int64_t mtime = in.getI64();
+            if (in.ok && mtime != -1 && dirModTime(dir) == mtime)
+                current[dir] = mtime;
+        }
+
+        FontIndex fonts;
+        for (uint32_t i = 0; in.ok && i < fontCount; ++i) {
+            IndexEntry entry;
+            std::string path = in.getString();
+            int index = in.getU32();
+            entry.size = in.getI64();
+            entry.mtime = in.getI64();
+            uint8_t flags = in.getU8();
+            if (flags & 1) {
+                entry.hasNames = true;
+                entry.names.m_psName = in.getString();
+                in.getList(entry.names.m_familyNames);
+                in.getList(entry.names.m_styleNames);
+                in.getList(entry.names.m_fullNames);
+            }
+            if (flags & 2) {
+                entry.hasStyle = true;
+                entry.opSizeInfo.designSize = in.getU32();
+                entry.opSizeInfo.subFamilyID = in.getU32();
+                entry.opSizeInfo.nameCode = in.getU32();
+                entry.opSizeInfo.minSize = in.getU32();
+                entry.opSizeInfo.maxSize = in.getU32();
+                entry.weight = in.getU16();
+                entry.width = in.getU16();
+                entry.slant = (int16_t) in.getU16();
+                entry.isReg = in.getU8() != 0;
+                entry.isBold = in.getU8() != 0;
+                entry.isItalic = in.getU8() != 0;
+            }
+            if (in.ok && current.find(dirOf(path)) != current.end())
+                fonts[std::pair<std::string,int>(path, index)] = entry;
+        }
+
+        if (in.ok) {
+            m_fontIndex = fonts;
+            m_dirTimes = current;
+            if (m_fontIndex.size() != fontCount)
+                m_indexChanged = true; // drop the stale entries next time
+        }
+    }
+
+#ifndef WIN32
+    munmap(mapped, size);
+#else
+    free(data);
+#endif
+}
+
+void
+XeTeXFontMgr_FC::saveFontIndex()
+{
+    if (m_indexFile.empty() || !m_indexChanged)
+        return;
+
+    IndexWriter out;
+    out.put(FONT_INDEX_MAGIC, 8);
+    out.putU32(FONT_INDEX_VERSION);
+    out.putU32(FONT_INDEX_BOM);
+    out.putU32(m_dirTimes.size());
+    out.putU32(m_fontIndex.size());
+    for (std::map<std::string,int64_t>::const_iterator i = m_dirTimes.begin(); i != m_dirTimes.end(); ++i) {
+        out.putString(i->first);
+        out.putI64(i->second);
+    }
+    for (FontIndex::const_iterator i = m_fontIndex.begin(); i != m_fontIndex.end(); ++i) {
+        const IndexEntry& entry = i->second;
+        out.putString(i->first.first);
+        out.putU32(i->first.second);
+        out.putI64(entry.size);
+        out.putI64(entry.mtime);
+        out.putU8((entry.hasNames ? 1 : 0) | (entry.hasStyle ? 2 : 0));
+        if (entry.hasNames) {
+            out.putString(entry.names.m_psName);
+            out.putList(entry.names.m_familyNames);
+            out.putList(entry.names.m_styleNames);
+            out.putList(entry.names.m_fullNames);
+        }
+        if (entry.hasStyle) {
+            out.putU32(entry.opSizeInfo.designSize);
+            out.putU32(entry.opSizeInfo.subFamilyID);
+            out.putU32(entry.opSizeInfo.nameCode);
+            out.putU32(entry.opSizeInfo.minSize);
+            out.putU32(entry.opSizeInfo.maxSize);
+            out.putU16(entry.weight);
+            out.putU16(entry.width);
+            out.putU16(entry.slant);
+            out.putU8(entry.isReg);
+            out.putU8(entry.isBold);
+            out.putU8(entry.isItalic);
+        }
+    }
+
+    // write a new file and move it into place, so concurrent runs never see a partial index
+    char pid[32];
+    sprintf(pid, ".%ld", (long) getpid());
+    std::string tmpFile = m_indexFile + pid;
+    FILE* f = fopen(tmpFile.c_str(), FOPEN_WBIN_MODE);
+    if (f == NULL)
+        return;
+    bool ok = fwrite(out.data.data(), 1, out.data.length(), f) == out.data.length();
+    ok = (fclose(f) == 0) && ok;
+#ifdef WIN32
+    if (ok)
+        remove(m_indexFile.c_str());
+#endif
+    if (!ok || rename(tmpFile.c_str(), m_indexFile.c_str()) != 0)
+        remove(tmpFile.c_str());
+    m_indexChanged = false;
 }
 
 void
@@ -335,11 +710,15 @@ XeTeXFontMgr_FC::initialize()
     FcPatternDestroy(pat);
 
     cachedAll = false;
+
+    loadFontIndex();
 }
 
 void
 XeTeXFontMgr_FC::terminate()
 {
+    saveFontIndex();
+
     if (macRomanConv != NULL)
         ucnv_close(macRomanConv);
     if (utf16beConv != NULL)
@@ -58,8 +58,49 @@ protected:
 
     void                            cacheFamilyMembers(const std::list<std::string>& familyNames);
 
+    NameCollection*                 readNamesFromFont(FcPattern* pat);
+
+    // persistent index of the names and style flags read from each font file,
+    // so that later runs need not open the fonts again
+    class IndexEntry {
+        public:
+                            IndexEntry()
+                                : size(-1), mtime(-1), checked(false)
+                                , hasNames(false), hasStyle(false)
+                                , weight(0), width(0), slant(0)
+                                , isReg(false), isBold(false), isItalic(false)
+                                { opSizeInfo.designSize = 100; opSizeInfo.subFamilyID = 0;
+                                  opSizeInfo.nameCode = 0; opSizeInfo.minSize = 0; opSizeInfo.maxSize = 0; }
+
+            int64_t         size;       // of the font file when the entry was made
+            int64_t         mtime;
+            bool            checked;    // against the file, in this run
+            bool            hasNames;
+            NameCollection  names;
+            bool            hasStyle;
+            OpSizeRec       opSizeInfo;
+            uint16_t        weight;
+            uint16_t        width;
+            int16_t         slant;
+            bool            isReg;
+            bool            isBold;
+            bool            isItalic;
+    };
+
+    typedef std::map<std::pair<std::string,int>,IndexEntry> FontIndex;
+
+    IndexEntry*                     getIndexEntry(FcPattern* pat);
+    void                            noteFontDir(const std::string& path);
+    void                            loadFontIndex();
+    void                            saveFontIndex();
+
     FcFontSet*  allFonts;
     bool        cachedAll;
+
+    FontIndex                       m_fontIndex;
+    std::map<std::string,int64_t>   m_dirTimes;    // mtimes of the directories holding indexed fonts
+    std::string                     m_indexFile;
+    bool                            m_indexChanged;
 };
 
 #endif  /* __XETEX_FONT_MGR_FC_H */
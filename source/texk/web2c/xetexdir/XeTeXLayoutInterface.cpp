@@ -35,7 +35,10 @@ authorization from the copyright holders.
 
 #include <unicode/platform.h>   // We need this first
 #include <unicode/ubidi.h>
+#include <unicode/uchar.h>
+#include <unicode/uscript.h>
 #include <unicode/utext.h>
+#include <unicode/utf16.h>
 
 #include <graphite2/Font.h>
 #include <graphite2/Segment.h>
@@ -52,6 +55,55 @@ authorization from the copyright holders.
 #endif
 #include "XeTeXFontMgr.h"
 
+#include <algorithm>
+#include <map>
+#include <vector>
+
+/* result of shaping one word, kept so that repeated measurements of the
+   same text with the same engine don't have to go through HarfBuzz again */
+struct ShapedWord
+{
+    std::vector<uint32_t>   glyphs;
+    std::vector<float>      advances;
+    std::vector<FloatPoint> positions;  // glyph count + 1 entries
+    hb_script_t             script;
+    std::vector<hb_glyph_info_t>        info;   // raw HarfBuzz output, for layoutFragment()
+    std::vector<hb_glyph_position_t>    pos;
+};
+
+// key is (offset, count, direction) followed by the complete UTF-16 text,
+// as HarfBuzz looks at the context around the run being shaped
+typedef std::map<std::vector<uint16_t>,ShapedWord> ShapedWordCache;
+
+// words longer than this are rarely repeated, so we don't bother caching them
+#define SHAPING_CACHE_MAX_LENGTH    64
+// when a font's cache grows beyond this many words, it is flushed
+#define SHAPING_CACHE_MAX_WORDS     8192
+
+/* raw HarfBuzz output for the last long left-to-right run shaped by an engine.
+   When main_control keeps appending fragments to the same native_word node,
+   the new text begins with this one and only its tail needs to be reshaped. */
+struct ShapedRun
+{
+    std::vector<uint16_t>               text;
+    std::vector<hb_glyph_info_t>        info;
+    std::vector<hb_glyph_position_t>    pos;
+    hb_script_t                         script;
+    ShapedWord                          word;   // info and pos as returned by getGlyphs() etc.
+    std::vector<FloatPoint>             pens;   // sums of the advances before each glyph, as copyGlyphPositions() makes them
+};
+
+// HarfBuzz 1.1.3 can't tell us where it is safe to break a shaped run, so when
+// reshaping the tail of a run we resume this many UTF-16 units before the end
+// of the old text, and require the new glyphs to agree with the old ones over
+// the first half of that window
+#define SHAPING_CONTEXT_WINDOW      32
+
+static integer sShapingCacheHits = 0;
+static integer sShapingCacheMisses = 0;
+static integer sShapingTailReshapes = 0;
+static integer sShapingFragmentSlices = 0;
+
 struct XeTeXLayoutEngine_rec
 {
     XeTeXFontInst*  font;
@@ -67,34 +119,89 @@ struct XeTeXLayoutEngine_rec
     float           slant;
     float           embolden;
     hb_buffer_t*    hbBuffer;
+    hb_script_t     lastScript; // script of the most recently shaped text
+    ShapedWordCache wordCache;
+    const ShapedWord* shapedWord; // non-NULL if the last layout came from the cache
+    ShapedRun       lastRun;
+    ShapedWord      fragment;   // glyphs cut from a cached word by layoutFragment()
+    const ShapedWord*       fragmentSource; // the cached word that was cut
+    std::vector<uint16_t>   fragmentText;   // its text
+    std::vector<int32_t>    fragmentCuts;   // char -> first glyph after a safe cut there, -1 if unsafe, -2 if unknown
+    std::vector<uint16_t>   nominalGlyphs;      // BMP char -> cmap glyph, 0xFFFF if not looked up yet
+    std::vector<int32_t>    nominalAdvances;    // glyph -> unkerned advance, -1 if not looked up yet
+    int             spaceIsInert; // -1 = not checked yet, see canReuseWordGlyphs()
+    hb_script_t     contextScript;  // script for which contextLookups was last worked out
+    bool            contextLookups; // see layoutFragment()
+    ShapedWord      merged;     // words joined at spaces by appendMergedWord() etc.
 };
 
 /*******************************************************************/
 /* Glyph bounding box cache to speed up \XeTeXuseglyphmetrics mode */
 /*******************************************************************/
-#include <map>
 
-// key is combined value representing (font_id << 16) + glyph
-// value is glyph bounding box in TeX points
-static std::map<uint32_t,GlyphBBox> sGlyphBoxes;
+// one dense table per TeX font, indexed by glyph ID and allocated on first
+// use (for all the glyphs in the font if the caller knows how many there are);
+// a bit per glyph records which entries have been filled in
+// values are glyph bounding boxes in TeX points
+struct GlyphBBoxTable {
+    unsigned int    size;
+    GlyphBBox*      boxes;
+    uint32_t*       known;
+};
+
+static std::vector<GlyphBBoxTable*> sGlyphBoxes;
+static integer sGlyphBoxBytes = 0;
 
 int
-getCachedGlyphBBox(uint16_t fontID, uint16_t glyphID, GlyphBBox* bbox)
+getCachedGlyphBBox(integer fontID, uint16_t glyphID, GlyphBBox* bbox)
 {
-    uint32_t key = ((uint32_t)fontID << 16) + glyphID;
-    std::map<uint32_t,GlyphBBox>::const_iterator i = sGlyphBoxes.find(key);
-    if (i == sGlyphBoxes.end()) {
+    if (fontID < 0 || (unsigned int)fontID >= sGlyphBoxes.size())
         return 0;
-    }
-    *bbox = i->second;
+    const GlyphBBoxTable* table = sGlyphBoxes[fontID];
+    if (table == NULL || glyphID >= table->size || (table->known[glyphID >> 5] & (1u << (glyphID & 31))) == 0)
+        return 0;
+    *bbox = table->boxes[glyphID];
     return 1;
 }
 
 void
-cacheGlyphBBox(uint16_t fontID, uint16_t glyphID, const GlyphBBox* bbox)
+cacheGlyphBBox(integer fontID, uint16_t glyphID, unsigned int numGlyphs, const GlyphBBox* bbox)
+{
+    if (fontID < 0)
+        return;
+    if ((unsigned int)fontID >= sGlyphBoxes.size())
+        sGlyphBoxes.resize(fontID + 1, NULL);
+
+    GlyphBBoxTable* table = sGlyphBoxes[fontID];
+    if (table == NULL) {
+        table = new GlyphBBoxTable;
+        table->size = 0;
+        table->boxes = NULL;
+        table->known = NULL;
+        sGlyphBoxes[fontID] = table;
+    }
+
+    if (glyphID >= table->size) {
+        // grow to the font's glyph count, or in steps if that isn't known
+        unsigned int newSize = numGlyphs;
+        if (newSize <= glyphID)
+            newSize = std::max(glyphID + 1u, std::min(2 * table->size, 65536u));
+        newSize = (newSize + 31) & ~31u;
+        table->boxes = (GlyphBBox*) xrealloc(table->boxes, newSize * sizeof(GlyphBBox));
+        table->known = (uint32_t*) xrealloc(table->known, newSize / 32 * sizeof(uint32_t));
+        memset(table->known + table->size / 32, 0, (newSize - table->size) / 32 * sizeof(uint32_t));
+        sGlyphBoxBytes += (newSize - table->size) * sizeof(GlyphBBox) + (newSize - table->size) / 8;
+        table->size = newSize;
+    }
+
+    table->boxes[glyphID] = *bbox;
+    table->known[glyphID >> 5] |= 1u << (glyphID & 31);
+}
+
+integer
+glyphbboxcachesize(void)
 {
-    uint32_t key = ((uint32_t)fontID << 16) + glyphID;
-    sGlyphBoxes[key] = *bbox;
+    return sGlyphBoxBytes;
 }
 /*******************************************************************/
 
@@ -639,6 +746,11 @@ createLayoutEngine(PlatformFontRef fontRef, XeTeXFont font, hb_tag_t script, cha
     result->slant = slant;
     result->embolden = embolden;
     result->hbBuffer = hb_buffer_create();
+    result->lastScript = HB_SCRIPT_INVALID;
+    result->shapedWord = NULL;
+    result->spaceIsInert = -1;
+    result->contextScript = HB_SCRIPT_INVALID;
+    result->fragmentSource = NULL;
 
     // For Graphite fonts treat the language as BCP 47 tag, for OpenType we
     // treat it as a OT language tag for backward compatibility with pre-0.9999
@@ -657,6 +769,10 @@ void
 deleteLayoutEngine(XeTeXLayoutEngine engine)
 {
     hb_buffer_destroy(engine->hbBuffer);
+    engine->wordCache.clear();
+    engine->shapedWord = NULL;
+    engine->lastRun.text.clear();
+    engine->fragmentSource = NULL;
     delete engine->font;
     free(engine->shaper);
 }
@@ -680,23 +796,17 @@ _get_unicode_funcs(void)
 
 static hb_unicode_funcs_t* hbUnicodeFuncs = NULL;
 
-int
-layoutChars(XeTeXLayoutEngine engine, uint16_t chars[], int32_t offset, int32_t count, int32_t max,
-                        bool rightToLeft)
+static int
+shapeRun(XeTeXLayoutEngine engine, uint16_t chars[], int32_t offset, int32_t count, int32_t max,
+         hb_direction_t direction)
 {
     bool res;
     hb_script_t script = HB_SCRIPT_INVALID;
-    hb_direction_t direction = HB_DIRECTION_LTR;
     hb_segment_properties_t segment_props;
     hb_shape_plan_t *shape_plan;
     hb_font_t* hbFont = engine->font->getHbFont();
     hb_face_t* hbFace = hb_font_get_face(hbFont);
 
-    if (engine->font->getLayoutDirVertical())
-        direction = HB_DIRECTION_TTB;
-    else if (rightToLeft)
-        direction = HB_DIRECTION_RTL;
-
     script = hb_ot_tag_to_script (engine->script);
 
     if (hbUnicodeFuncs == NULL)
@@ -748,6 +858,7 @@ layoutChars(XeTeXLayoutEngine engine, uint16_t chars[], int32_t offset, int32_t
     hb_shape_plan_destroy(shape_plan);
 
     int glyphCount = hb_buffer_get_length(engine->hbBuffer);
+    engine->lastScript = hb_buffer_get_script(engine->hbBuffer);
 
 #ifdef DEBUG
     char buf[1024];
@@ -766,22 +877,414 @@ layoutChars(XeTeXLayoutEngine engine, uint16_t chars[], int32_t offset, int32_t
     return glyphCount;
 }
 
-void
-getGlyphs(XeTeXLayoutEngine engine, uint32_t glyphs[])
+static void copyGlyphs(const hb_glyph_info_t* hbGlyphs, int glyphCount, uint32_t glyphs[]);
+static void copyGlyphAdvances(XeTeXLayoutEngine engine, const hb_glyph_position_t* hbPositions, int glyphCount, float advances[]);
+static void copyGlyphPositions(XeTeXLayoutEngine engine, const hb_glyph_position_t* hbPositions, int glyphCount, FloatPoint positions[],
+                               FloatPoint pens[] = NULL);
+
+static void
+setLastRunWord(XeTeXLayoutEngine engine, int32_t from)
+    /* bring the word of the last run up to date from glyph from onwards */
+{
+    ShapedRun& run = engine->lastRun;
+    int glyphCount = run.info.size();
+
+    run.word.glyphs.resize(glyphCount);
+    run.word.advances.resize(glyphCount);
+    run.word.positions.resize(glyphCount + 1);
+    run.pens.resize(glyphCount + 1);
+    run.word.script = run.script;
+    if (from == 0)
+        run.pens[0].x = run.pens[0].y = 0;
+    if (glyphCount > from) {
+        copyGlyphs(&run.info[from], glyphCount - from, &run.word.glyphs[from]);
+        copyGlyphAdvances(engine, &run.pos[from], glyphCount - from, &run.word.advances[from]);
+    }
+    copyGlyphPositions(engine, glyphCount > from ? &run.pos[from] : NULL, glyphCount - from,
+                       &run.word.positions[from], &run.pens[from]);
+}
+
+static void
+recordLastRun(XeTeXLayoutEngine engine, const uint16_t chars[], int32_t max)
+    /* keep the buffer contents after shaping the whole of chars[0..max) */
 {
-    int glyphCount = hb_buffer_get_length(engine->hbBuffer);
-    hb_glyph_info_t *hbGlyphs = hb_buffer_get_glyph_infos(engine->hbBuffer, NULL);
+    ShapedRun& run = engine->lastRun;
+    unsigned int glyphCount;
+    hb_glyph_info_t* hbGlyphs = hb_buffer_get_glyph_infos(engine->hbBuffer, &glyphCount);
+    hb_glyph_position_t* hbPositions = hb_buffer_get_glyph_positions(engine->hbBuffer, NULL);
+
+    run.text.assign(chars, chars + max);
+    run.info.assign(hbGlyphs, hbGlyphs + glyphCount);
+    run.pos.assign(hbPositions, hbPositions + glyphCount);
+    run.script = engine->lastScript;
+    setLastRunWord(engine, 0);
+}
+
+static bool
+reshapeLastRunTail(XeTeXLayoutEngine engine, uint16_t chars[], int32_t max)
+    /* if chars[0..max) extends the engine's last run, shape only its tail and
+       splice the result onto the glyphs of the unchanged part */
+{
+    ShapedRun& run = engine->lastRun;
+    int32_t oldLen = run.text.size();
+
+    if (oldLen <= SHAPING_CONTEXT_WINDOW || oldLen > max
+            || memcmp(&run.text[0], chars, oldLen * sizeof(uint16_t)) != 0)
+        return false;
+
+    if (oldLen < max) {
+        // resume at the last cluster boundary at least a full window before
+        // the end of the old text
+        int32_t oldGlyphs = run.info.size();
+        int32_t limit = oldLen - SHAPING_CONTEXT_WINDOW;
+        int32_t g;
+        for (g = oldGlyphs - 1; g > 0; --g)
+            if (run.info[g].cluster <= (uint32_t)limit && run.info[g].cluster > run.info[g - 1].cluster)
+                break;
+        if (g <= 0)
+            return false;
+        int32_t resume = run.info[g].cluster;
+
+        int newGlyphs = shapeRun(engine, chars, resume, max - resume, max, HB_DIRECTION_LTR);
+        if (engine->lastScript != run.script)
+            return false;
+        hb_glyph_info_t* hbGlyphs = hb_buffer_get_glyph_infos(engine->hbBuffer, NULL);
+        hb_glyph_position_t* hbPositions = hb_buffer_get_glyph_positions(engine->hbBuffer, NULL);
+
+        // the tail must reproduce the old glyphs for half a window, showing
+        // that nothing before the resumption point affected them
+        uint32_t check = resume + SHAPING_CONTEXT_WINDOW / 2;
+        int k;
+        for (k = 0; g + k < oldGlyphs && run.info[g + k].cluster < check; ++k) {
+            const hb_glyph_info_t& oi = run.info[g + k];
+            const hb_glyph_position_t& op = run.pos[g + k];
+            if (k >= newGlyphs || hbGlyphs[k].codepoint != oi.codepoint || hbGlyphs[k].cluster != oi.cluster
+                    || hbPositions[k].x_advance != op.x_advance || hbPositions[k].y_advance != op.y_advance
+                    || hbPositions[k].x_offset != op.x_offset || hbPositions[k].y_offset != op.y_offset)
+                return false;
+        }
+        if (g + k == oldGlyphs || k >= newGlyphs || hbGlyphs[k].cluster < check)
+            return false;
+
+        run.text.insert(run.text.end(), chars + oldLen, chars + max);
+        run.info.resize(g);
+        run.info.insert(run.info.end(), hbGlyphs, hbGlyphs + newGlyphs);
+        run.pos.resize(g);
+        run.pos.insert(run.pos.end(), hbPositions, hbPositions + newGlyphs);
+        setLastRunWord(engine, g);
+    }
+
+    engine->lastScript = run.script;
+    engine->shapedWord = &run.word;
+    return true;
+}
+
+int
+layoutChars(XeTeXLayoutEngine engine, uint16_t chars[], int32_t offset, int32_t count, int32_t max,
+                        bool rightToLeft)
+{
+    hb_direction_t direction = HB_DIRECTION_LTR;
+
+    if (engine->font->getLayoutDirVertical())
+        direction = HB_DIRECTION_TTB;
+    else if (rightToLeft)
+        direction = HB_DIRECTION_RTL;
+
+    engine->shapedWord = NULL;
+
+    std::vector<uint16_t> key;
+    if (max <= SHAPING_CACHE_MAX_LENGTH) {
+        key.reserve(max + 3);
+        key.push_back(offset);
+        key.push_back(count);
+        key.push_back(direction);
+        key.insert(key.end(), chars, chars + max);
+
+        ShapedWordCache::const_iterator i = engine->wordCache.find(key);
+        if (i != engine->wordCache.end()) {
+            sShapingCacheHits++;
+            engine->shapedWord = &i->second;
+            engine->lastScript = i->second.script;
+            return i->second.glyphs.size();
+        }
+    }
+
+    // a long run that is shaped as a whole may be the previous one with more
+    // text appended
+    bool wholeRun = key.empty() && offset == 0 && count == max && direction == HB_DIRECTION_LTR;
+    if (wholeRun && reshapeLastRunTail(engine, chars, max)) {
+        sShapingTailReshapes++;
+        return engine->shapedWord->glyphs.size();
+    }
+    sShapingCacheMisses++;
+
+    int glyphCount = shapeRun(engine, chars, offset, count, max, direction);
+
+    if (!key.empty()) {
+        if (engine->wordCache.size() >= SHAPING_CACHE_MAX_WORDS) {
+            engine->wordCache.clear();
+            engine->fragmentSource = NULL;
+        }
+
+        ShapedWord& word = engine->wordCache[key];
+        word.glyphs.resize(glyphCount);
+        word.advances.resize(glyphCount);
+        word.positions.resize(glyphCount + 1);
+        word.script = engine->lastScript;
+        if (glyphCount > 0) {
+            getGlyphs(engine, &word.glyphs[0]);
+            getGlyphAdvances(engine, &word.advances[0]);
+        }
+        getGlyphPositions(engine, &word.positions[0]);
+        hb_glyph_info_t* hbGlyphs = hb_buffer_get_glyph_infos(engine->hbBuffer, NULL);
+        hb_glyph_position_t* hbPositions = hb_buffer_get_glyph_positions(engine->hbBuffer, NULL);
+        word.info.assign(hbGlyphs, hbGlyphs + glyphCount);
+        word.pos.assign(hbPositions, hbPositions + glyphCount);
+        engine->shapedWord = &word;
+    } else if (wholeRun) {
+        recordLastRun(engine, chars, max);
+        engine->shapedWord = &engine->lastRun.word;
+    }
+
+    return glyphCount;
+}
+
+integer
+shapingcachehits(void)
+{
+    return sShapingCacheHits;
+}
+
+integer
+shapingcachemisses(void)
+{
+    return sShapingCacheMisses;
+}
+
+integer
+shapingtailreshapes(void)
+{
+    return sShapingTailReshapes;
+}
+
+integer
+shapingfragmentslices(void)
+{
+    return sShapingFragmentSlices;
+}
+
+static int32_t
+findSafeCut(XeTeXLayoutEngine engine, const ShapedWord& word, const uint16_t chars[], int32_t cut)
+    /* is there a glyph boundary in word, the shaping of chars, at character
+       cut that shaping the two sides separately would reproduce?  If so,
+       return the index of the first glyph after it, else -1 */
+{
+    int32_t n = word.info.size();
+    int32_t g;
+
+    for (g = 0; g < n && word.info[g].cluster < (uint32_t)cut; ++g)
+        ;
+    if (g == 0 || g == n || word.info[g].cluster != (uint32_t)cut || word.info[g - 1].cluster != (uint32_t)cut - 1
+            || (g > 1 && word.info[g - 2].cluster >= (uint32_t)cut - 1)
+            || (g + 1 < n && word.info[g + 1].cluster <= (uint32_t)cut))
+        return -1;
+
+    // HarfBuzz 1.1.3 has no unsafe-to-break flag, so we only cut between two
+    // glyphs that are each the plain cmap glyph for one character, neither
+    // moved nor kerned; then no lookup can have joined them
+    hb_font_t* hbFont = engine->font->getHbFont();
+    if (engine->nominalGlyphs.empty())
+        engine->nominalGlyphs.assign(0x10000, 0xFFFF);
+    for (int k = g - 1; k <= g; ++k) {
+        uint16_t c = chars[word.info[k].cluster];
+        if ((c & 0xF800) == 0xD800)
+            return -1;
+        uint16_t& gid = engine->nominalGlyphs[c];
+        if (gid == 0xFFFF) {
+            hb_codepoint_t cmapGlyph;
+            gid = hb_font_get_glyph(hbFont, c, 0, &cmapGlyph) && cmapGlyph < 0xFFFF ? cmapGlyph : 0;
+        }
+        if (gid == 0 || gid != word.info[k].codepoint)
+            return -1;
+
+        const hb_glyph_position_t& p = word.pos[k];
+        if (p.x_offset != 0 || p.y_offset != 0 || p.y_advance != 0)
+            return -1;
+        if (gid >= engine->nominalAdvances.size())
+            engine->nominalAdvances.resize(gid + 1, -1);
+        int32_t& advance = engine->nominalAdvances[gid];
+        if (advance == -1)
+            advance = hb_font_get_glyph_h_advance(hbFont, gid);
+        if (p.x_advance != advance)
+            return -1;
+    }
+    return g;
+}
+
+static bool
+lookupsUseContext(hb_face_t* face, hb_tag_t tableTag, hb_set_t* lookups)
+    /* true if any of the lookups is a contextual or chaining one (GSUB 5, 6
+       and 8, GPOS 7 and 8, also behind extension lookups), which can change
+       a glyph because of others that are not next to it */
+{
+    hb_blob_t* blob = hb_face_reference_table(face, tableTag);
+    unsigned int length;
+    const uint8_t* data = (const uint8_t*) hb_blob_get_data(blob, &length);
+    bool gsub = tableTag == HB_OT_TAG_GSUB;
+    bool found = false;
+
+#define READ_U16(o) ((o) + 2 <= length ? (unsigned int)(data[o] << 8 | data[(o) + 1]) : 0)
+#define CONTEXTUAL(t) (gsub ? (t) == 5 || (t) == 6 || (t) == 8 : (t) == 7 || (t) == 8)
+    unsigned int lookupList = READ_U16(8);
+    unsigned int lookupCount = lookupList != 0 ? READ_U16(lookupList) : 0;
+    hb_codepoint_t i = HB_SET_VALUE_INVALID;
+    while (!found && hb_set_next(lookups, &i)) {
+        if (i >= lookupCount)
+            continue;
+        unsigned int lookup = lookupList + READ_U16(lookupList + 2 + 2 * i);
+        unsigned int type = READ_U16(lookup);
+        if (type == (gsub ? 7u : 9u)) {
+            // extension lookup: each subtable gives the real type
+            unsigned int subTables = READ_U16(lookup + 4);
+            for (unsigned int j = 0; j < subTables && !found; ++j) {
+                unsigned int subTable = lookup + READ_U16(lookup + 6 + 2 * j);
+                unsigned int extType = READ_U16(subTable + 2);
+                found = CONTEXTUAL(extType);
+            }
+        } else
+            found = CONTEXTUAL(type);
+    }
+#undef CONTEXTUAL
+#undef READ_U16
+
+    hb_blob_destroy(blob);
+    return found;
+}
+
+static bool
+shapingUsesContext(XeTeXLayoutEngine engine, hb_script_t script)
+    /* true if shaping left-to-right text of the given script with the
+       engine's features applies any contextual or chaining lookups */
+{
+    if (engine->contextScript == script)
+        return engine->contextLookups;
+
+    hb_font_t* hbFont = engine->font->getHbFont();
+    hb_face_t* hbFace = hb_font_get_face(hbFont);
+    hb_segment_properties_t props = HB_SEGMENT_PROPERTIES_DEFAULT;
+    props.direction = HB_DIRECTION_LTR;
+    props.script = script;
+    props.language = engine->language != HB_LANGUAGE_INVALID ? engine->language : hb_language_get_default();
+
+    hb_shape_plan_t* plan = hb_shape_plan_create_cached(hbFace, &props, engine->features, engine->nFeatures, engine->ShaperList);
+    hb_set_t* lookups = hb_set_create();
+    bool context = false;
+    for (int i = 0; i < 2 && !context; ++i) {
+        hb_tag_t tableTag = i == 0 ? HB_OT_TAG_GSUB : HB_OT_TAG_GPOS;
+        hb_set_clear(lookups);
+        hb_ot_shape_plan_collect_lookups(plan, tableTag, lookups);
+        context = lookupsUseContext(hbFace, tableTag, lookups);
+    }
+    hb_set_destroy(lookups);
+    hb_shape_plan_destroy(plan);
+
+    engine->contextScript = script;
+    engine->contextLookups = context;
+    return context;
+}
+
+static hb_script_t
+guessScript(const uint16_t chars[], int32_t count)
+    /* the script that hb_buffer_guess_segment_properties() would pick */
+{
+    for (int32_t i = 0; i < count; ++i) {
+        UChar32 c = chars[i];
+        if ((c & 0xFC00) == 0xD800 && i + 1 < count && (chars[i + 1] & 0xFC00) == 0xDC00)
+            c = U16_GET_SUPPLEMENTARY(c, chars[++i]);
+        hb_script_t script = hb_unicode_script(hbUnicodeFuncs, c);
+        if (script != HB_SCRIPT_COMMON && script != HB_SCRIPT_INHERITED && script != HB_SCRIPT_UNKNOWN)
+            return script;
+    }
+    return HB_SCRIPT_INVALID;
+}
+
+int
+layoutFragment(XeTeXLayoutEngine engine, uint16_t chars[], int32_t max, int32_t start, int32_t end)
+    /* lay out chars[start..end) left to right by cutting its glyphs out of
+       the shaping of the whole of chars[0..max), as when hyphenation splits
+       a word that has been shaped before; returns -1 if that isn't safe,
+       and the caller must shape the fragment on its own */
+{
+    // Graphite rules can look further than the neighbouring glyphs
+    if (engine->font->getLayoutDirVertical() || max > SHAPING_CACHE_MAX_LENGTH
+            || engine->shaper == NULL || strcmp(engine->shaper, "ot") != 0)
+        return -1;
+
+    // line_break cuts up one word at a time, so remember where it is safe to
+    // cut the last one
+    const ShapedWord* word = engine->fragmentSource;
+    if (word == NULL || engine->fragmentText.size() != (size_t)max
+            || !std::equal(engine->fragmentText.begin(), engine->fragmentText.end(), chars)) {
+        layoutChars(engine, chars, 0, max, max, false);
+        word = engine->shapedWord;
+        if (word == NULL || word->info.size() != word->glyphs.size())
+            return -1;
+        engine->fragmentSource = word;
+        engine->fragmentText.assign(chars, chars + max);
+        engine->fragmentCuts.assign(max + 1, -2);
+        engine->fragmentCuts[0] = 0;
+        engine->fragmentCuts[max] = word->info.size();
+    }
+
+    // findSafeCut() only looks at the glyphs on either side of a cut, but a
+    // contextual lookup can also have changed glyphs further away because of
+    // characters across it
+    if (shapingUsesContext(engine, word->script))
+        return -1;
+
+    int32_t& first = engine->fragmentCuts[start];
+    if (first == -2)
+        first = findSafeCut(engine, *word, chars, start);
+    int32_t& last = engine->fragmentCuts[end];
+    if (last == -2)
+        last = findSafeCut(engine, *word, chars, end);
+    if (first < 0 || last < 0)
+        return -1;
+
+    hb_script_t script = word->script;
+    if (hbUnicodeFuncs == NULL)
+        hbUnicodeFuncs = _get_unicode_funcs();
+    if (hb_ot_tag_to_script(engine->script) == HB_SCRIPT_INVALID && guessScript(chars + start, end - start) != script)
+        return -1;
+
+    ShapedWord& fragment = engine->fragment;
+    int32_t glyphCount = last - first;
+    fragment.glyphs.resize(glyphCount);
+    fragment.advances.resize(glyphCount);
+    fragment.positions.resize(glyphCount + 1);
+    fragment.script = script;
+    if (glyphCount > 0) {
+        copyGlyphs(&word->info[first], glyphCount, &fragment.glyphs[0]);
+        copyGlyphAdvances(engine, &word->pos[first], glyphCount, &fragment.advances[0]);
+    }
+    copyGlyphPositions(engine, glyphCount > 0 ? &word->pos[first] : NULL, glyphCount, &fragment.positions[0]);
+
+    sShapingFragmentSlices++;
+    engine->lastScript = script;
+    engine->shapedWord = &fragment;
+    return glyphCount;
+}
 
+static void
+copyGlyphs(const hb_glyph_info_t* hbGlyphs, int glyphCount, uint32_t glyphs[])
+{
     for (int i = 0; i < glyphCount; i++)
         glyphs[i] = hbGlyphs[i].codepoint;
 }
 
-void
-getGlyphAdvances(XeTeXLayoutEngine engine, float advances[])
+static void
+copyGlyphAdvances(XeTeXLayoutEngine engine, const hb_glyph_position_t* hbPositions, int glyphCount, float advances[])
 {
-    int glyphCount = hb_buffer_get_length(engine->hbBuffer);
-    hb_glyph_position_t *hbPositions = hb_buffer_get_glyph_positions(engine->hbBuffer, NULL);
-
     for (int i = 0; i < glyphCount; i++) {
         if (engine->font->getLayoutDirVertical())
             advances[i] = engine->font->unitsToPoints(hbPositions[i].y_advance);
@@ -790,20 +1293,28 @@ getGlyphAdvances(XeTeXLayoutEngine engine, float advances[])
     }
 }
 
-void
-getGlyphPositions(XeTeXLayoutEngine engine, FloatPoint positions[])
+static void
+copyGlyphPositions(XeTeXLayoutEngine engine, const hb_glyph_position_t* hbPositions, int glyphCount, FloatPoint positions[],
+                   FloatPoint pens[])
+    /* if pens is given, start from the sums of the advances in pens[0], and
+       leave the sums after each glyph in pens[1..glyphCount] */
 {
-    int glyphCount = hb_buffer_get_length(engine->hbBuffer);
-    hb_glyph_position_t *hbPositions = hb_buffer_get_glyph_positions(engine->hbBuffer, NULL);
-
     float x = 0, y = 0;
 
+    if (pens != NULL) {
+        x = pens[0].x;
+        y = pens[0].y;
+    }
     if (engine->font->getLayoutDirVertical()) {
         for (int i = 0; i < glyphCount; i++) {
             positions[i].x = -engine->font->unitsToPoints(x + hbPositions[i].y_offset); /* negative is forwards */
             positions[i].y =  engine->font->unitsToPoints(y - hbPositions[i].x_offset);
             x += hbPositions[i].y_advance;
             y += hbPositions[i].x_advance;
+            if (pens != NULL) {
+                pens[i + 1].x = x;
+                pens[i + 1].y = y;
+            }
         }
         positions[glyphCount].x = -engine->font->unitsToPoints(x);
         positions[glyphCount].y =  engine->font->unitsToPoints(y);
@@ -813,6 +1324,10 @@ getGlyphPositions(XeTeXLayoutEngine engine, FloatPoint positions[])
             positions[i].y = -engine->font->unitsToPoints(y + hbPositions[i].y_offset); /* negative is upwards */
             x += hbPositions[i].x_advance;
             y += hbPositions[i].y_advance;
+            if (pens != NULL) {
+                pens[i + 1].x = x;
+                pens[i + 1].y = y;
+            }
         }
         positions[glyphCount].x =  engine->font->unitsToPoints(x);
         positions[glyphCount].y = -engine->font->unitsToPoints(y);
@@ -823,6 +1338,217 @@ getGlyphPositions(XeTeXLayoutEngine engine, FloatPoint positions[])
             positions[i].x = positions[i].x * engine->extend - positions[i].y * engine->slant;
 }
 
+void
+getGlyphs(XeTeXLayoutEngine engine, uint32_t glyphs[])
+{
+    if (engine->shapedWord != NULL) {
+        std::copy(engine->shapedWord->glyphs.begin(), engine->shapedWord->glyphs.end(), glyphs);
+        return;
+    }
+
+    copyGlyphs(hb_buffer_get_glyph_infos(engine->hbBuffer, NULL), hb_buffer_get_length(engine->hbBuffer), glyphs);
+}
+
+void
+getGlyphAdvances(XeTeXLayoutEngine engine, float advances[])
+{
+    if (engine->shapedWord != NULL) {
+        std::copy(engine->shapedWord->advances.begin(), engine->shapedWord->advances.end(), advances);
+        return;
+    }
+
+    copyGlyphAdvances(engine, hb_buffer_get_glyph_positions(engine->hbBuffer, NULL),
+                      hb_buffer_get_length(engine->hbBuffer), advances);
+}
+
+void
+getGlyphPositions(XeTeXLayoutEngine engine, FloatPoint positions[])
+{
+    if (engine->shapedWord != NULL) {
+        std::copy(engine->shapedWord->positions.begin(), engine->shapedWord->positions.end(), positions);
+        return;
+    }
+
+    copyGlyphPositions(engine, hb_buffer_get_glyph_positions(engine->hbBuffer, NULL),
+                       hb_buffer_get_length(engine->hbBuffer), positions);
+}
+
+static bool
+spaceIsInert(XeTeXLayoutEngine engine)
+    /* true if no GSUB or GPOS lookup (nor legacy kerning) can involve the space glyph */
+{
+    hb_font_t* hbFont = engine->font->getHbFont();
+    hb_face_t* hbFace = hb_font_get_face(hbFont);
+    hb_codepoint_t space = engine->font->mapCharToGlyph(' ');
+
+    if (space == 0)
+        return false;
+
+    if (!hb_ot_layout_has_positioning(hbFace) && engine->font->hasKerning())
+        return false;
+
+    bool inert = true;
+    hb_set_t* lookups = hb_set_create();
+    hb_set_t* glyphs = hb_set_create();
+    for (int i = 0; i < 2 && inert; ++i) {
+        hb_tag_t tableTag = i == 0 ? HB_OT_TAG_GSUB : HB_OT_TAG_GPOS;
+        hb_codepoint_t lookup = HB_SET_VALUE_INVALID;
+
+        hb_set_clear(lookups);
+        hb_ot_layout_collect_lookups(hbFace, tableTag, NULL, NULL, NULL, lookups);
+        while (inert && hb_set_next(lookups, &lookup)) {
+            hb_set_clear(glyphs);
+            hb_ot_layout_lookup_collect_glyphs(hbFace, tableTag, lookup, glyphs, glyphs, glyphs, NULL);
+            if (hb_set_has(glyphs, space))
+                inert = false;
+        }
+    }
+    hb_set_destroy(glyphs);
+    hb_set_destroy(lookups);
+
+    return inert;
+}
+
+bool
+canReuseWordGlyphs(XeTeXLayoutEngine engine, const uint16_t* text, int len)
+    /* Words shaped separately can be joined at spaces without shaping the whole
+       text again if the space glyph cannot interact with its neighbours, and the
+       text is a single left-to-right run whose words all resolve to one script. */
+{
+    if (engine->font->getLayoutDirVertical() || usingGraphite(engine))
+        return false;
+
+    if (engine->spaceIsInert == -1)
+        engine->spaceIsInert = spaceIsInert(engine);
+    if (!engine->spaceIsInert)
+        return false;
+
+    if (getDefaultDirection(engine) != UBIDI_DEFAULT_LTR)
+        return false;
+
+    UScriptCode textScript = USCRIPT_COMMON;
+    bool wordStart = true, wordHasScript = false, allWordsHaveScript = true;
+    int i = 0;
+    while (i < len) {
+        UChar32 c;
+        U16_NEXT(text, i, len, c);
+
+        if (c == ' ') {
+            if (!wordStart && !wordHasScript)
+                allWordsHaveScript = false;
+            wordStart = true;
+            wordHasScript = false;
+            continue;
+        }
+
+        switch (u_charDirection(c)) {
+            case U_RIGHT_TO_LEFT:
+            case U_RIGHT_TO_LEFT_ARABIC:
+            case U_ARABIC_NUMBER:
+            case U_LEFT_TO_RIGHT_EMBEDDING:
+            case U_LEFT_TO_RIGHT_OVERRIDE:
+            case U_RIGHT_TO_LEFT_EMBEDDING:
+            case U_RIGHT_TO_LEFT_OVERRIDE:
+            case U_POP_DIRECTIONAL_FORMAT:
+                return false;
+            default:
+                break;
+        }
+
+        /* a word starting with a mark would attach differently after a space */
+        if (wordStart && i > U16_LENGTH(c) && (U_GET_GC_MASK(c) & U_GC_M_MASK))
+            return false;
+        wordStart = false;
+
+        UErrorCode status = U_ZERO_ERROR;
+        UScriptCode script = uscript_getScript(c, &status);
+        if (U_FAILURE(status))
+            return false;
+        if (script == USCRIPT_COMMON || script == USCRIPT_INHERITED)
+            continue;
+        if (textScript == USCRIPT_COMMON)
+            textScript = script;
+        else if (script != textScript)
+            return false;
+        wordHasScript = true;
+    }
+    if (!wordStart && !wordHasScript)
+        allWordsHaveScript = false;
+
+    /* a word with no script of its own is shaped differently when on its own */
+    if (textScript != USCRIPT_COMMON && !allWordsHaveScript)
+        return false;
+
+    return true;
+}
+
+void
+beginMergedGlyphs(XeTeXLayoutEngine engine)
+{
+    engine->merged.info.clear();
+    engine->merged.pos.clear();
+}
+
+void
+appendMergedWord(XeTeXLayoutEngine engine, uint16_t chars[], int32_t len)
+    /* append the raw HarfBuzz output for chars[0..len) shaped on its own */
+{
+    ShapedWord& merged = engine->merged;
+
+    layoutChars(engine, chars, 0, len, len, false);
+    const ShapedWord* word = engine->shapedWord;
+    if (word == &engine->lastRun.word) {
+        merged.info.insert(merged.info.end(), engine->lastRun.info.begin(), engine->lastRun.info.end());
+        merged.pos.insert(merged.pos.end(), engine->lastRun.pos.begin(), engine->lastRun.pos.end());
+    } else if (word != NULL) {
+        merged.info.insert(merged.info.end(), word->info.begin(), word->info.end());
+        merged.pos.insert(merged.pos.end(), word->pos.begin(), word->pos.end());
+    } else {
+        unsigned int glyphCount;
+        hb_glyph_info_t* hbGlyphs = hb_buffer_get_glyph_infos(engine->hbBuffer, &glyphCount);
+        hb_glyph_position_t* hbPositions = hb_buffer_get_glyph_positions(engine->hbBuffer, NULL);
+        merged.info.insert(merged.info.end(), hbGlyphs, hbGlyphs + glyphCount);
+        merged.pos.insert(merged.pos.end(), hbPositions, hbPositions + glyphCount);
+    }
+}
+
+void
+appendMergedSpace(XeTeXLayoutEngine engine)
+    /* append the space glyph as HarfBuzz leaves it when no lookup touches it */
+{
+    hb_glyph_info_t info;
+    hb_glyph_position_t pos;
+
+    memset(&info, 0, sizeof(info));
+    memset(&pos, 0, sizeof(pos));
+    info.codepoint = engine->font->mapCharToGlyph(' ');
+    pos.x_advance = hb_font_get_glyph_h_advance(engine->font->getHbFont(), info.codepoint);
+    engine->merged.info.push_back(info);
+    engine->merged.pos.push_back(pos);
+}
+
+int
+endMergedGlyphs(XeTeXLayoutEngine engine)
+    /* make the merged glyphs the result of the last layout; their positions
+       are accumulated just as for the joined text shaped as a whole */
+{
+    ShapedWord& merged = engine->merged;
+    int glyphCount = merged.info.size();
+
+    merged.glyphs.resize(glyphCount);
+    merged.advances.resize(glyphCount);
+    merged.positions.resize(glyphCount + 1);
+    merged.script = engine->lastScript;
+    if (glyphCount > 0) {
+        copyGlyphs(&merged.info[0], glyphCount, &merged.glyphs[0]);
+        copyGlyphAdvances(engine, &merged.pos[0], glyphCount, &merged.advances[0]);
+    }
+    copyGlyphPositions(engine, glyphCount > 0 ? &merged.pos[0] : NULL, glyphCount, &merged.positions[0]);
+    engine->shapedWord = &merged;
+
+    return glyphCount;
+}
+
 float
 getPointSize(XeTeXLayoutEngine engine)
 {
@@ -846,7 +1572,7 @@ getCapAndXHeight(XeTeXLayoutEngine engine, float* capheight, float* xheight)
 int
 getDefaultDirection(XeTeXLayoutEngine engine)
 {
-    hb_script_t script = hb_buffer_get_script(engine->hbBuffer);
+    hb_script_t script = engine->lastScript;
     if (hb_script_get_horizontal_direction (script) == HB_DIRECTION_RTL)
         return UBIDI_DEFAULT_RTL;
     else
@@ -58,8 +58,9 @@ extern "C" {
 
 extern char gPrefEngine;
 
-int getCachedGlyphBBox(uint16_t fontID, uint16_t glyphID, GlyphBBox* bbox);
-void cacheGlyphBBox(uint16_t fontID, uint16_t glyphID, const GlyphBBox* bbox);
+int getCachedGlyphBBox(integer fontID, uint16_t glyphID, GlyphBBox* bbox);
+void cacheGlyphBBox(integer fontID, uint16_t glyphID, unsigned int numGlyphs, const GlyphBBox* bbox);
+integer glyphbboxcachesize(void);
 
 void terminatefontmanager();
 
@@ -111,10 +112,23 @@ float getEmboldenFactor(XeTeXLayoutEngine engine);
 int layoutChars(XeTeXLayoutEngine engine, uint16_t* chars, int32_t offset, int32_t count, int32_t max,
                         bool rightToLeft);
 
+integer shapingcachehits(void);
+integer shapingcachemisses(void);
+integer shapingtailreshapes(void);
+integer shapingfragmentslices(void);
+
+int layoutFragment(XeTeXLayoutEngine engine, uint16_t* chars, int32_t max, int32_t start, int32_t end);
+
 void getGlyphs(XeTeXLayoutEngine engine, uint32_t* glyphs);
 void getGlyphAdvances(XeTeXLayoutEngine engine, float *advances);
 void getGlyphPositions(XeTeXLayoutEngine engine, FloatPoint* positions);
 
+bool canReuseWordGlyphs(XeTeXLayoutEngine engine, const uint16_t* text, int len);
+void beginMergedGlyphs(XeTeXLayoutEngine engine);
+void appendMergedWord(XeTeXLayoutEngine engine, uint16_t* chars, int32_t len);
+void appendMergedSpace(XeTeXLayoutEngine engine);
+int endMergedGlyphs(XeTeXLayoutEngine engine);
+
 float getPointSize(XeTeXLayoutEngine engine);
 
 void getAscentAndDescent(XeTeXLayoutEngine engine, float* ascent, float* descent);
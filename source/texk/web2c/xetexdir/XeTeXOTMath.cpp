@@ -35,6 +35,9 @@ authorization from the copyright holders.
 
 #include <assert.h>
 
+#include <algorithm>
+#include <map>
+
 #include "XeTeXOTMath.h"
 
 #include "XeTeX_web.h"
@@ -42,47 +45,284 @@ authorization from the copyright holders.
 #include "XeTeXFontInst.h"
 #include "XeTeXswap.h"
 
-static int32_t getCoverage(const Coverage* coverage, GlyphID g)
+void OTMathTable::GlyphCoverage::read(const char* coverage)
 {
-    if (SWAP(coverage->format) == 1) {
-        const CoverageFormat1 *table = (const CoverageFormat1 *) coverage;
-        for (int i = 0; i < SWAP(table->glyphCount); i++) {
-            if (SWAP(table->glyphArray[i]) == g)
-                return i;
+    uint16_t format = SWAP(((const Coverage*)coverage)->format);
+
+    if (format == 1) {
+        const CoverageFormat1* table = (const CoverageFormat1*) coverage;
+        uint16_t count = SWAP(table->glyphCount);
+        for (int i = 0; i < count; i++) {
+            GlyphID g = SWAP(table->glyphArray[i]);
+            if (!m_ranges.empty() && m_ranges.back().end + 1 == g) {
+                m_ranges.back().end = g;
+            } else {
+                Range r = { g, g, i };
+                m_ranges.push_back(r);
+            }
         }
-    } else if (SWAP(coverage->format) == 2) {
-        const CoverageFormat2 *table = (const CoverageFormat2 *) coverage;
-        for (int i = 0; i < SWAP(table->rangeCount); i++) {
-            if (SWAP(table->rangeArray[i].start) <= g && SWAP(table->rangeArray[i].end) >= g)
-                return SWAP(table->rangeArray[i].startCoverageIndex) + (g - SWAP(table->rangeArray[i].start));
+    } else if (format == 2) {
+        const CoverageFormat2* table = (const CoverageFormat2*) coverage;
+        uint16_t count = SWAP(table->rangeCount);
+        for (int i = 0; i < count; i++) {
+            Range r = {
+                SWAP(table->rangeArray[i].start),
+                SWAP(table->rangeArray[i].end),
+                SWAP(table->rangeArray[i].startCoverageIndex)
+            };
+            if (r.start <= r.end)
+                m_ranges.push_back(r);
         }
     }
 
-    return -1;
+    // both formats are sorted by glyph ID in well-formed fonts
+    std::stable_sort(m_ranges.begin(), m_ranges.end());
 }
 
-static int16_t getMathConstant(XeTeXFontInst* fontInst, mathConstantIndex whichConstant)
+int32_t OTMathTable::GlyphCoverage::lookup(GlyphID g) const
 {
-    const char* table = fontInst->getMathTable();
-    if (table == NULL)
-        return 0;
+    Range key = { g, g, 0 };
+    std::vector<Range>::const_iterator r = std::upper_bound(m_ranges.begin(), m_ranges.end(), key);
+    if (r == m_ranges.begin())
+        return -1;
+    --r;
+    if (r->end < g)
+        return -1;
+    return r->index + (g - r->start);
+}
 
-    const uint16_t* constants = (const uint16_t*)(table + SWAP(((const MathTableHeader*)table)->mathConstants));
+OTMathTable::OTMathTable(const char* table)
+    : m_minConnectorOverlap(0)
+{
+    const MathTableHeader* header = (const MathTableHeader*) table;
+    const uint16_t* constants = (const uint16_t*)(table + SWAP(header->mathConstants));
+    const MathValueRecord* valueRecords = (const MathValueRecord*)(constants + firstMathValueRecord);
+
+    for (int i = 0; i <= lastMathConstant; i++) {
+        if (i < firstMathValueRecord) {
+            /* it's a simple 16-bit value */
+            m_constants[i] = SWAP(constants[i]);
+        } else if (i <= lastMathValueRecord) {
+            m_constants[i] = SWAP(valueRecords[i - firstMathValueRecord].value);
+        } else {
+            m_constants[i] = SWAP(constants[i + (lastMathValueRecord - firstMathValueRecord + 1)]);
+        }
+    }
 
-    if (whichConstant < firstMathValueRecord) {
-        /* it's a simple 16-bit value */
-        return SWAP(constants[whichConstant]);
+    uint16_t offset = SWAP(header->mathGlyphInfo);
+    if (offset != 0)
+        readGlyphInfo(table + offset);
+
+    offset = SWAP(header->mathVariants);
+    if (offset != 0)
+        readVariants(table + offset);
+}
+
+void OTMathTable::readGlyphInfo(const char* glyphInfo)
+{
+    uint16_t offset = SWAP(((const MathGlyphInfo*)glyphInfo)->mathItalicsCorrectionInfo);
+    if (offset != 0) {
+        const MathItalicsCorrectionInfo* italCorrInfo = (const MathItalicsCorrectionInfo*)(glyphInfo + offset);
+        offset = SWAP(italCorrInfo->coverage);
+        if (offset != 0) {
+            m_italicsCorrectionCoverage.read((const char*)italCorrInfo + offset);
+            uint16_t count = SWAP(italCorrInfo->italicsCorrectionCount);
+            for (int i = 0; i < count; i++)
+                m_italicsCorrections.push_back(SWAP(italCorrInfo->italicsCorrection[i].value));
+        }
     }
-    else if (whichConstant <= lastMathValueRecord) {
-        const MathValueRecord* valueRecords = (const MathValueRecord*)
-            ((char*)constants + firstMathValueRecord * sizeof(uint16_t) - firstMathValueRecord * sizeof(MathValueRecord));
-        return SWAP(valueRecords[whichConstant].value);
+
+    offset = SWAP(((const MathGlyphInfo*)glyphInfo)->mathTopAccentAttachment);
+    if (offset != 0) {
+        const MathTopAccentAttachment* accentAttachment = (const MathTopAccentAttachment*)(glyphInfo + offset);
+        offset = SWAP(accentAttachment->coverage);
+        if (offset != 0) {
+            m_topAccentCoverage.read((const char*)accentAttachment + offset);
+            uint16_t count = SWAP(accentAttachment->topAccentAttachmentCount);
+            for (int i = 0; i < count; i++)
+                m_topAccentAttachments.push_back(SWAP(accentAttachment->topAccentAttachment[i].value));
+        }
     }
-    else if (whichConstant <= lastMathConstant) {
-        return SWAP(constants[whichConstant + (lastMathValueRecord - firstMathValueRecord + 1)]);
+
+    offset = SWAP(((const MathGlyphInfo*)glyphInfo)->mathKernInfo);
+    if (offset != 0) {
+        const MathKernInfo* mathKernInfo = (const MathKernInfo*)(glyphInfo + offset);
+        offset = SWAP(mathKernInfo->coverage);
+        if (offset != 0) {
+            m_kernCoverage.read((const char*)mathKernInfo + offset);
+            uint16_t count = SWAP(mathKernInfo->kernInfoCount);
+            std::map<uint16_t, int32_t> tableIndex; // kern tables are often shared between glyphs
+            for (int i = 0; i < count; i++) {
+                const Offset* sides = (const Offset*) &mathKernInfo->kernInfo[i];
+                for (int side = topRight; side <= bottomLeft; side++) {
+                    int32_t index = -1;
+                    offset = SWAP(sides[side]);
+                    if (offset != 0) {
+                        std::map<uint16_t, int32_t>::iterator t = tableIndex.find(offset);
+                        if (t == tableIndex.end())
+                            index = tableIndex[offset] = readKernTable((const char*)mathKernInfo + offset);
+                        else
+                            index = t->second;
+                    }
+                    m_kernInfo.push_back(index);
+                }
+            }
+        }
     }
-    else
+}
+
+int32_t OTMathTable::readKernTable(const char* kernTable)
+{
+    const MathKernTable* table = (const MathKernTable*) kernTable;
+    KernTable kern;
+
+    // heightCount heights followed by heightCount + 1 kern values
+    const MathValueRecord* records = table->height;
+    kern.count = SWAP(table->heightCount);
+    int recordCount = 2 * kern.count + 1;
+    for (int i = 0; i < recordCount; i++)
+        kern.values.push_back(SWAP(records[i].value));
+
+    m_kernTables.push_back(kern);
+    return m_kernTables.size() - 1;
+}
+
+void OTMathTable::readVariants(const char* variants)
+{
+    const MathVariants* table = (const MathVariants*) variants;
+    m_minConnectorOverlap = SWAP(table->minConnectorOverlap);
+
+    uint16_t offset = SWAP(table->vertGlyphCoverage);
+    if (offset != 0)
+        m_vertCoverage.read(variants + offset);
+    offset = SWAP(table->horizGlyphCoverage);
+    if (offset != 0)
+        m_horizCoverage.read(variants + offset);
+
+    // the horizontal construction offsets follow the vertical ones; go
+    // through a plain pointer, as the array is declared with one element
+    const Offset* constructionOffsets = table->vertGlyphConstruction;
+    uint16_t vertCount = SWAP(table->vertGlyphCount);
+    uint16_t horizCount = SWAP(table->horizGlyphCount);
+    for (int i = 0; i < vertCount + horizCount; i++) {
+        const MathGlyphConstruction* construction = (const MathGlyphConstruction*)(variants
+                                                        + SWAP(constructionOffsets[i]));
+        std::vector<OTMathConstruction>& constructions = i < vertCount ? m_vertConstructions : m_horizConstructions;
+        constructions.push_back(OTMathConstruction());
+        OTMathConstruction& c = constructions.back();
+
+        uint16_t count = SWAP(construction->variantCount);
+        for (int j = 0; j < count; j++) {
+            OTMathVariant v = {
+                SWAP(construction->mathGlyphVariantRecord[j].variantGlyph),
+                SWAP(construction->mathGlyphVariantRecord[j].advanceMeasurement)
+            };
+            c.variants.push_back(v);
+        }
+
+        offset = SWAP(construction->glyphAssembly);
+        c.hasAssembly = offset != 0;
+        if (c.hasAssembly) {
+            const GlyphAssembly* assembly = (const GlyphAssembly*)(((const char*)construction) + offset);
+            count = SWAP(assembly->partCount);
+            for (int j = 0; j < count; j++) {
+                const GlyphPartRecord& r = assembly->partRecords[j];
+                OTMathGlyphPart part = {
+                    SWAP(r.glyph),
+                    SWAP(r.startConnectorLength),
+                    SWAP(r.endConnectorLength),
+                    SWAP(r.fullAdvance),
+                    (SWAP(r.partFlags) & fExtender) != 0
+                };
+                c.assembly.parts.push_back(part);
+            }
+        }
+    }
+}
+
+int16_t OTMathTable::constant(mathConstantIndex which) const
+{
+    if (which < 0 || which > lastMathConstant)
         return 0; /* or abort, with "internal error" or something */
+    return m_constants[which];
+}
+
+bool OTMathTable::italicsCorrection(GlyphID g, int16_t& value) const
+{
+    int32_t index = m_italicsCorrectionCoverage.lookup(g);
+    if (index < 0 || index >= (int32_t) m_italicsCorrections.size())
+        return false;
+    value = m_italicsCorrections[index];
+    return true;
+}
+
+bool OTMathTable::topAccentAttachment(GlyphID g, int16_t& value) const
+{
+    int32_t index = m_topAccentCoverage.lookup(g);
+    if (index < 0 || index >= (int32_t) m_topAccentAttachments.size())
+        return false;
+    value = m_topAccentAttachments[index];
+    return true;
+}
+
+const OTMathConstruction* OTMathTable::construction(GlyphID g, bool horiz) const
+{
+    const std::vector<OTMathConstruction>& constructions = horiz ? m_horizConstructions : m_vertConstructions;
+    int32_t index = (horiz ? m_horizCoverage : m_vertCoverage).lookup(g);
+    if (index < 0 || index >= (int32_t) constructions.size())
+        return NULL;
+    return &constructions[index];
+}
+
+bool OTMathTable::mathKern(GlyphID g, MathKernSide side, int height, int16_t& value) const
+{
+    int32_t index = m_kernCoverage.lookup(g);
+    if (index < 0 || index >= (int32_t) m_kernInfo.size() / 4)
+        return false;
+    index = m_kernInfo[4 * index + side];
+    if (index < 0)
+        return false;
+
+    const KernTable& kernTable = m_kernTables[index];
+    const std::vector<int16_t>& v = kernTable.values;
+    uint16_t count = kernTable.count;
+    // the lookups below may point past the kern values of short tables
+    size_t last = v.size() - 1;
+
+    // XXX: the following makes no sense WRT my understanding of the
+    // spec! it is just how things worked for me.
+    if (count == 0)
+        value = v[0];
+    else if (height < v[0])
+        value = v[std::min<size_t>(2, last)];
+    else if (height > v[count])
+        value = v[std::min<size_t>(count + 2, last)];
+    else {
+        value = 0;
+        for (int i = 0; i < count; i++) {
+            if (height > v[i]) {
+                value = v[std::min<size_t>(i + 2, last)];
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+static const OTMathTable* getOTMathTable(int f, XeTeXFontInst** font)
+{
+    if (fontarea[f] != OTGR_FONT_FLAG)
+        return NULL;
+    *font = (XeTeXFontInst*)getFont((XeTeXLayoutEngine)fontlayoutengine[f]);
+    return (*font)->getOTMathTable();
+}
+
+static int16_t getMathConstant(XeTeXFontInst* fontInst, mathConstantIndex whichConstant)
+{
+    const OTMathTable* table = fontInst->getOTMathTable();
+    if (table == NULL)
+        return 0;
+    return table->constant(whichConstant);
 }
 
 int
@@ -214,34 +454,15 @@ get_ot_math_variant(int f, int g, int v, integer* adv, int horiz)
     int rval = g;
     *adv = -1;
 
-    if (fontarea[f] == OTGR_FONT_FLAG) {
-        XeTeXFontInst*  font = (XeTeXFontInst*)getFont((XeTeXLayoutEngine)fontlayoutengine[f]);
+    XeTeXFontInst* font;
+    const OTMathTable* table = getOTMathTable(f, &font);
+    if (table == NULL)
+        return rval;
 
-        const char* table = font->getMathTable();
-        if (table == NULL)
-            return rval;
-
-        uint16_t    offset = SWAP(((const MathTableHeader*)table)->mathVariants);
-        if (offset == 0)
-            return rval;
-        const MathVariants* variants = (const MathVariants*)(table + offset);
-
-        offset = horiz ? SWAP(variants->horizGlyphCoverage) : SWAP(variants->vertGlyphCoverage);
-        if (offset == 0)
-            return rval;
-        const Coverage* coverage = (const Coverage*)(((const char*)variants) + offset);
-
-        int32_t index = getCoverage(coverage, g);
-        if (index >= 0) {
-            if (horiz)
-                index += SWAP(variants->vertGlyphCount);
-            const MathGlyphConstruction*    construction = (const MathGlyphConstruction*)(((const char*)variants)
-                                                            + SWAP(variants->vertGlyphConstruction[index]));
-            if (v < SWAP(construction->variantCount)) {
-                rval = SWAP(construction->mathGlyphVariantRecord[v].variantGlyph);
-                *adv = D2Fix(font->unitsToPoints(SWAP(construction->mathGlyphVariantRecord[v].advanceMeasurement)));
-            }
-        }
+    const OTMathConstruction* construction = table->construction(g, horiz);
+    if (construction != NULL && v >= 0 && v < (int) construction->variants.size()) {
+        rval = construction->variants[v].glyph;
+        *adv = D2Fix(font->unitsToPoints(construction->variants[v].advance));
     }
 
     return rval;
@@ -250,38 +471,16 @@ get_ot_math_variant(int f, int g, int v, integer* adv, int horiz)
 void*
 get_ot_assembly_ptr(int f, int g, int horiz)
 {
-    void*   rval = NULL;
+    XeTeXFontInst* font;
+    const OTMathTable* table = getOTMathTable(f, &font);
+    if (table == NULL)
+        return NULL;
 
-    if (fontarea[f] == OTGR_FONT_FLAG) {
-        XeTeXFontInst*  font = (XeTeXFontInst*)getFont((XeTeXLayoutEngine)fontlayoutengine[f]);
+    const OTMathConstruction* construction = table->construction(g, horiz);
+    if (construction == NULL || !construction->hasAssembly)
+        return NULL;
 
-        const char* table = font->getMathTable();
-        if (table == NULL)
-            return rval;
-
-        uint16_t    offset = SWAP(((const MathTableHeader*)table)->mathVariants);
-        if (offset == 0)
-            return rval;
-        const MathVariants* variants = (const MathVariants*)(table + offset);
-
-        offset = horiz ? SWAP(variants->horizGlyphCoverage) : SWAP(variants->vertGlyphCoverage);
-        if (offset == 0)
-            return rval;
-        const Coverage* coverage = (const Coverage*)(((const char*)variants) + offset);
-
-        int32_t index = getCoverage(coverage, g);
-        if (index >= 0) {
-            if (horiz)
-                index += SWAP(variants->vertGlyphCount);
-            const MathGlyphConstruction*    construction = (const MathGlyphConstruction*)(((const char*)variants)
-                                                            + SWAP(variants->vertGlyphConstruction[index]));
-            offset = SWAP(construction->glyphAssembly);
-            if (offset != 0)
-                rval = (void*)(((const char*)construction) + offset);
-        }
-    }
-
-    return rval;
+    return (void*) &construction->assembly;
 }
 
 int
@@ -289,32 +488,11 @@ get_ot_math_ital_corr(int f, int g)
 {
     int rval = 0;
 
-    if (fontarea[f] == OTGR_FONT_FLAG) {
-        XeTeXFontInst*  font = (XeTeXFontInst*)getFont((XeTeXLayoutEngine)fontlayoutengine[f]);
-
-        const char* table = font->getMathTable();
-        if (table == NULL)
-            return rval;
-
-        uint16_t    offset = SWAP(((const MathTableHeader*)table)->mathGlyphInfo);
-        if (offset == 0)
-            return rval;
-        const MathGlyphInfo* glyphInfo = (const MathGlyphInfo*)(table + offset);
-
-        offset = SWAP(glyphInfo->mathItalicsCorrectionInfo);
-        if (offset == 0)
-            return rval;
-        const MathItalicsCorrectionInfo* italCorrInfo = (const MathItalicsCorrectionInfo*)(((const char*)glyphInfo) + offset);
-
-        offset = SWAP(italCorrInfo->coverage);
-        if (offset == 0)
-            return rval;
-        const Coverage* coverage = (const Coverage*)(((const char*)italCorrInfo) + offset);
-
-        int32_t index = getCoverage(coverage, g);
-        if (index >= 0 && index < SWAP(italCorrInfo->italicsCorrectionCount))
-            rval = D2Fix(font->unitsToPoints(SWAP(italCorrInfo->italicsCorrection[index].value)));
-    }
+    XeTeXFontInst* font;
+    const OTMathTable* table = getOTMathTable(f, &font);
+    int16_t value;
+    if (table != NULL && table->italicsCorrection(g, value))
+        rval = D2Fix(font->unitsToPoints(value));
 
     return rval;
 }
@@ -324,34 +502,11 @@ get_ot_math_accent_pos(int f, int g)
 {
     int rval = 0x7fffffffUL;
 
-    if (fontarea[f] == OTGR_FONT_FLAG) {
-        XeTeXFontInst*  font = (XeTeXFontInst*)getFont((XeTeXLayoutEngine)fontlayoutengine[f]);
-
-        const char* table = font->getMathTable();
-        if (table == NULL)
-            return rval;
-
-        uint16_t    offset = SWAP(((const MathTableHeader*)table)->mathGlyphInfo);
-        if (offset == 0)
-            return rval;
-        const MathGlyphInfo* glyphInfo = (const MathGlyphInfo*)(table + offset);
-
-        offset = SWAP(glyphInfo->mathTopAccentAttachment);
-        if (offset == 0)
-            return rval;
-        const MathTopAccentAttachment* accentAttachment = (const MathTopAccentAttachment*)(((const char*)glyphInfo) + offset);
-
-        offset = SWAP(accentAttachment->coverage);
-        if (offset == 0)
-            return rval;
-        const Coverage* coverage = (const Coverage*)(((const char*)accentAttachment) + offset);
-
-        int32_t index = getCoverage(coverage, g);
-        if (index >= 0 && index < SWAP(accentAttachment->topAccentAttachmentCount)) {
-            rval = (int16_t)SWAP(accentAttachment->topAccentAttachment[index].value);
-            rval = D2Fix(font->unitsToPoints(rval));
-        }
-    }
+    XeTeXFontInst* font;
+    const OTMathTable* table = getOTMathTable(f, &font);
+    int16_t value;
+    if (table != NULL && table->topAccentAttachment(g, value))
+        rval = D2Fix(font->unitsToPoints(value));
 
     return rval;
 }
@@ -361,101 +516,26 @@ ot_min_connector_overlap(int f)
 {
     int rval = 0;
 
-    if (fontarea[f] == OTGR_FONT_FLAG) {
-        XeTeXFontInst*  font = (XeTeXFontInst*)getFont((XeTeXLayoutEngine)fontlayoutengine[f]);
-
-        const char* table = font->getMathTable();
-        if (table == NULL)
-            return rval;
-
-        uint16_t    offset = SWAP(((const MathTableHeader*)table)->mathVariants);
-        if (offset == 0)
-            return rval;
-        const MathVariants* variants = (const MathVariants*)(table + offset);
-
-        rval = D2Fix(font->unitsToPoints(SWAP(variants->minConnectorOverlap)));
-    }
+    XeTeXFontInst* font;
+    const OTMathTable* table = getOTMathTable(f, &font);
+    if (table != NULL)
+        rval = D2Fix(font->unitsToPoints(table->minConnectorOverlap()));
 
     return rval;
 }
 
-typedef enum {
-    topRight,
-    topLeft,
-    bottomRight,
-    bottomLeft,
-} MathKernSide;
-
 static int
 getMathKernAt(int f, int g, MathKernSide side, int height)
 {
     int rval = 0;
-    if (fontarea[f] == OTGR_FONT_FLAG) {
-        XeTeXFontInst* font = (XeTeXFontInst*)getFont((XeTeXLayoutEngine)fontlayoutengine[f]);
-
-        const char* table = font->getMathTable();
-        if (table == NULL)
-            return rval;
-
-        uint16_t    offset = SWAP(((const MathTableHeader*)table)->mathGlyphInfo);
-        if (offset == 0)
-            return rval;
-
-        const MathGlyphInfo* glyphInfo = (const MathGlyphInfo*)(table + offset);
-
-        offset = SWAP(glyphInfo->mathKernInfo);
-        if (offset == 0)
-            return rval;
-
-        const MathKernInfo* mathKernInfo = (const MathKernInfo*)(((const char*)glyphInfo) + offset);
 
-        offset = SWAP(mathKernInfo->coverage);
-        if (offset == 0)
-            return rval;
-
-        const Coverage* coverage = (const Coverage*)(((const char*)mathKernInfo) + offset);
-
-        int32_t index = getCoverage(coverage, g);
-        if (index >= 0 && index < SWAP(mathKernInfo->kernInfoCount)) {
-            if (side == topRight)
-                offset = SWAP(mathKernInfo->kernInfo[index].topRight);
-            else if (side == bottomRight)
-                offset = SWAP(mathKernInfo->kernInfo[index].bottomRight);
-            else if (side == topLeft)
-                offset = SWAP(mathKernInfo->kernInfo[index].topLeft);
-            else if (side == bottomLeft)
-                offset = SWAP(mathKernInfo->kernInfo[index].bottomLeft);
-            else
-                assert(0); // we should not reach here
-
-            if (offset == 0)
-                return rval;
-
-            const MathKernTable* kernTable = (const MathKernTable*)(((const char*)mathKernInfo) + offset);
-
-            uint16_t count = SWAP(kernTable->heightCount);
-
-            // XXX: the following makes no sense WRT my understanding of the
-            // spec! it is just how things worked for me.
-            if (count == 0)
-                rval = SWAP(kernTable->kern[-1].value);
-            else if (height < SWAP(kernTable->height[0].value))
-                rval = SWAP(kernTable->kern[1].value);
-            else if (height > SWAP(kernTable->height[count].value))
-                rval = SWAP(kernTable->kern[count+1].value);
-            else {
-                for (int i = 0; i < count; i++) {
-                    if (height > SWAP(kernTable->height[i].value)) {
-                        rval = SWAP(kernTable->kern[i+1].value);
-                        break;
-                    }
-                }
-            }
-
-            //fprintf(stderr, "   kern: %f %f\n", font->unitsToPoints(height), font->unitsToPoints(rval));
-        }
-    }
+    XeTeXFontInst* font;
+    const OTMathTable* table = getOTMathTable(f, &font);
+    int16_t value;
+    if (table != NULL && table->mathKern(g, side, height, value))
+        rval = value;
 
+    //fprintf(stderr, "   kern: %f %f\n", font->unitsToPoints(height), font->unitsToPoints(rval));
     return rval;
 }
 
@@ -538,57 +618,57 @@ get_ot_math_kern(int f, int g, int sf, int sg, int cmd, int shift)
 }
 
 int
-ot_part_count(const GlyphAssembly* a)
+ot_part_count(const OTMathAssembly* a)
 {
-    return SWAP(a->partCount);
+    return a->parts.size();
 }
 
 int
-ot_part_glyph(const GlyphAssembly* a, int i)
+ot_part_glyph(const OTMathAssembly* a, int i)
 {
-    return SWAP(a->partRecords[i].glyph);
+    return a->parts[i].glyph;
 }
 
 int
-ot_part_is_extender(const GlyphAssembly* a, int i)
+ot_part_is_extender(const OTMathAssembly* a, int i)
 {
-    return (SWAP(a->partRecords[i].partFlags) & fExtender) != 0;
+    return a->parts[i].extender;
 }
 
 int
-ot_part_start_connector(int f, const GlyphAssembly* a, int i)
+ot_part_start_connector(int f, const OTMathAssembly* a, int i)
 {
     int rval = 0;
 
     if (fontarea[f] == OTGR_FONT_FLAG) {
         XeTeXFontInst*  font = (XeTeXFontInst*)getFont((XeTeXLayoutEngine)fontlayoutengine[f]);
-        rval = D2Fix(font->unitsToPoints(SWAP(a->partRecords[i].startConnectorLength)));
+        rval = D2Fix(font->unitsToPoints(a->parts[i].startConnectorLength));
     }
 
     return rval;
 }
 
 int
-ot_part_end_connector(int f, const GlyphAssembly* a, int i)
+ot_part_end_connector(int f, const OTMathAssembly* a, int i)
 {
     int rval = 0;
 
     if (fontarea[f] == OTGR_FONT_FLAG) {
         XeTeXFontInst*  font = (XeTeXFontInst*)getFont((XeTeXLayoutEngine)fontlayoutengine[f]);
-        rval = D2Fix(font->unitsToPoints(SWAP(a->partRecords[i].endConnectorLength)));
+        rval = D2Fix(font->unitsToPoints(a->parts[i].endConnectorLength));
     }
 
     return rval;
 }
 
 int
-ot_part_full_advance(int f, const GlyphAssembly* a, int i)
+ot_part_full_advance(int f, const OTMathAssembly* a, int i)
 {
     int rval = 0;
 
     if (fontarea[f] == OTGR_FONT_FLAG) {
         XeTeXFontInst*  font = (XeTeXFontInst*)getFont((XeTeXLayoutEngine)fontlayoutengine[f]);
-        rval = D2Fix(font->unitsToPoints(SWAP(a->partRecords[i].fullAdvance)));
+        rval = D2Fix(font->unitsToPoints(a->parts[i].fullAdvance));
     }
 
     return rval;
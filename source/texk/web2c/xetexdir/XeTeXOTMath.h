@@ -36,6 +36,103 @@ authorization from the copyright holders.
 #include "XeTeX_ext.h"
 #include "MathTable.h"
 
+/* a glyph assembly from the MATH table, see OTMathTable below */
+typedef struct OTMathAssembly OTMathAssembly;
+
+#ifdef __cplusplus
+#include <vector>
+
+typedef enum {
+    topRight,
+    topLeft,
+    bottomRight,
+    bottomLeft,
+} MathKernSide;
+
+struct OTMathGlyphPart {
+    GlyphID glyph;
+    uint16_t startConnectorLength;
+    uint16_t endConnectorLength;
+    uint16_t fullAdvance;
+    bool extender;
+};
+
+struct OTMathAssembly {
+    std::vector<OTMathGlyphPart> parts;
+};
+
+struct OTMathVariant {
+    GlyphID glyph;
+    uint16_t advance;
+};
+
+struct OTMathConstruction {
+    std::vector<OTMathVariant> variants;
+    bool hasAssembly;
+    OTMathAssembly assembly;
+};
+
+/* The MATH table of a font, read once into native byte order: coverage
+   tables become sorted glyph ranges that are searched by bisection, and
+   the per-glyph records they index are copied into plain arrays. */
+class OTMathTable
+{
+public:
+    OTMathTable(const char* table);
+
+    int16_t constant(mathConstantIndex which) const;
+    bool italicsCorrection(GlyphID g, int16_t& value) const;
+    bool topAccentAttachment(GlyphID g, int16_t& value) const;
+    bool mathKern(GlyphID g, MathKernSide side, int height, int16_t& value) const;
+    const OTMathConstruction* construction(GlyphID g, bool horiz) const;
+    uint16_t minConnectorOverlap() const { return m_minConnectorOverlap; }
+
+private:
+    class GlyphCoverage
+    {
+    public:
+        void read(const char* coverage);
+        int32_t lookup(GlyphID g) const;
+
+    private:
+        struct Range {
+            GlyphID start;
+            GlyphID end;
+            int32_t index;
+            bool operator<(const Range& r) const { return start < r.start; }
+        };
+        std::vector<Range> m_ranges;
+    };
+
+    struct KernTable {
+        uint16_t count;
+        std::vector<int16_t> values; // the heights, then the kerns
+    };
+
+    void readGlyphInfo(const char* glyphInfo);
+    void readVariants(const char* variants);
+    int32_t readKernTable(const char* kernTable);
+
+    int16_t m_constants[lastMathConstant + 1];
+
+    GlyphCoverage m_italicsCorrectionCoverage;
+    std::vector<int16_t> m_italicsCorrections;
+
+    GlyphCoverage m_topAccentCoverage;
+    std::vector<int16_t> m_topAccentAttachments;
+
+    GlyphCoverage m_kernCoverage;
+    std::vector<int32_t> m_kernInfo; // 4 indices into m_kernTables per glyph, or -1
+    std::vector<KernTable> m_kernTables;
+
+    uint16_t m_minConnectorOverlap;
+    GlyphCoverage m_vertCoverage;
+    GlyphCoverage m_horizCoverage;
+    std::vector<OTMathConstruction> m_vertConstructions;
+    std::vector<OTMathConstruction> m_horizConstructions;
+};
+#endif
+
 /* public "C" APIs for calling from Web(-to-C) code */
 #ifdef __cplusplus
 extern "C" {
@@ -48,12 +145,12 @@ extern "C" {
     int get_ot_math_ital_corr(int f, int g);
     int get_ot_math_accent_pos(int f, int g);
     int get_ot_math_kern(int f, int g, int sf, int sg, int cmd, int shift);
-    int ot_part_count(const GlyphAssembly* a);
-    int ot_part_glyph(const GlyphAssembly* a, int i);
-    int ot_part_is_extender(const GlyphAssembly* a, int i);
-    int ot_part_start_connector(int f, const GlyphAssembly* a, int i);
-    int ot_part_end_connector(int f, const GlyphAssembly* a, int i);
-    int ot_part_full_advance(int f, const GlyphAssembly* a, int i);
+    int ot_part_count(const OTMathAssembly* a);
+    int ot_part_glyph(const OTMathAssembly* a, int i);
+    int ot_part_is_extender(const OTMathAssembly* a, int i);
+    int ot_part_start_connector(int f, const OTMathAssembly* a, int i);
+    int ot_part_end_connector(int f, const OTMathAssembly* a, int i);
+    int ot_part_full_advance(int f, const OTMathAssembly* a, int i);
     int ot_min_connector_overlap(int f);
 #ifdef __cplusplus
 };
@@ -84,7 +84,9 @@ authorization from the copyright holders.
 
 #include <unicode/ubidi.h>
 #include <unicode/ubrk.h>
+#include <unicode/uchar.h>
 #include <unicode/ucnv.h>
+#include <unicode/unorm2.h>
 
 #include <assert.h>
 
@@ -308,7 +310,30 @@ apply_normalization(uint32_t* buf, int len, int norm)
 
     TECkit_Status status;
     UInt32 inUsed, outUsed;
-    TECkit_Converter *normPtr = &normalizers[norm - 1];
+    TECkit_Converter *normPtr;
+    int i, done;
+
+    /* Most lines are already normalized: find the first character that is
+       not a starter known to stay as it is (everything below U+00C0 is).
+       Copy the text up to the one before it, which it might combine with,
+       and normalize only the rest. */
+    for (done = 0; done < len; done++) {
+        uint32_t c = buf[done];
+        if (c >= 0xC0 && (u_getCombiningClass(c) != 0
+                || u_getIntPropertyValue(c, norm == 1 ? UCHAR_NFC_QUICK_CHECK : UCHAR_NFD_QUICK_CHECK) != UNORM_YES))
+            break;
+    }
+    if (done < len && done > 0)
+        --done;
+    if (done > bufsize - first)
+        buffer_overflow();
+    for (i = 0; i < done; i++)
+        buffer[first + i] = buf[i];
+    last = first + done;
+    if (done == len)
+        return;
+
+    normPtr = &normalizers[norm - 1];
     if (*normPtr == NULL) {
         status = TECkit_CreateConverter(NULL, 0, 1,
             NATIVE_UTF32, NATIVE_UTF32 | (norm == 1 ? kForm_NFC : kForm_NFD),
@@ -319,11 +344,11 @@ apply_normalization(uint32_t* buf, int len, int norm)
         }
     }
 
-    status = TECkit_ConvertBuffer(*normPtr, (Byte*)buf, len * sizeof(UInt32), &inUsed,
-                (Byte*)&buffer[first], sizeof(*buffer) * (bufsize - first), &outUsed, 1);
+    status = TECkit_ConvertBuffer(*normPtr, (Byte*)(buf + done), (len - done) * sizeof(UInt32), &inUsed,
+                (Byte*)&buffer[last], sizeof(*buffer) * (bufsize - last), &outUsed, 1);
     if (status != kStatus_NoError)
         buffer_overflow();
-    last = first + outUsed / sizeof(*buffer);
+    last += outUsed / sizeof(*buffer);
 }
 
 #ifdef WORDS_BIGENDIAN
@@ -332,6 +357,119 @@ apply_normalization(uint32_t* buf, int len, int norm)
 #define UCNV_UTF32_NativeEndian UCNV_UTF32_LittleEndian
 #endif
 
+/* Decoding a character of a UTF-8 or UTF-16 file, once its first byte or
+   code unit has been read; shared by get_uni_c and read_uni_line. */
+static inline int
+get_utf8_rest(UFILE* f, int rval)
+{
+    int c;
+    uint16_t extraBytes = bytesFromUTF8[rval];
+    switch (extraBytes) {   /* note: code falls through cases! */
+        case 3: c = GETC(f->f);
+            if (c < 0x80 || c >= 0xc0) goto bad_utf8;
+            rval <<= 6; rval += c;
+        case 2: c = GETC(f->f);
+            if (c < 0x80 || c >= 0xc0) goto bad_utf8;
+            rval <<= 6; rval += c;
+        case 1: c = GETC(f->f);
+            if (c < 0x80 || c >= 0xc0) goto bad_utf8;
+            rval <<= 6; rval += c;
+        case 0:
+            break;
+
+        bad_utf8:
+            if (c != EOF)
+                UNGETC(c, f->f);
+        case 5:
+        case 4:
+            badutf8warning();
+            return 0xfffd;      /* return without adjusting by offsetsFromUTF8 */
+    };
+    return rval - offsetsFromUTF8[extraBytes];
+}
+
+static inline int
+get_utf16_unit(UFILE* f)
+{
+    int rval = GETC(f->f);
+    if (rval != EOF) {
+        if (f->encodingMode == UTF16BE) {
+            rval <<= 8;
+            rval += GETC(f->f);
+        } else
+            rval += (GETC(f->f) << 8);
+    }
+    return rval;
+}
+
+static inline int
+get_utf16_rest(UFILE* f, int rval)
+{
+    if (rval >= 0xd800 && rval <= 0xdbff) {
+        int lo = get_utf16_unit(f);
+        if (lo >= 0xdc00 && lo <= 0xdfff)
+            rval = 0x10000 + (rval - 0xd800) * 0x400 + (lo - 0xdc00);
+        else {
+            rval = 0xfffd;
+            f->savedChar = lo;
+        }
+    } else if (rval >= 0xdc00 && rval <= 0xdfff)
+        rval = 0xfffd;
+    return rval;
+}
+
+/* Read the rest of a line whose first character |i| has been read, into
+   |out| from |*len| on, stopping at the end of the line, the end of the
+   file, or after |room| characters; return the last character read, as
+   the loops over get_uni_c in input_line would leave it.  UTF-8 and
+   UTF-16 are decoded here, straight from the stdio buffer, so that the
+   common characters cost a byte test each rather than a call.  */
+static int
+read_uni_line(UFILE* f, int i, uint32_t* out, int* len, int room)
+{
+    int n = *len;
+
+    if (i == EOF || i == '\n' || i == '\r' || n >= room)
+        return i;
+    out[n++] = i;
+
+    if (f->savedChar == -1) {
+        FILE* fp = f->f;
+        switch (f->encodingMode) {
+            case UTF8:
+                while (n < room) {
+                    i = GETC(fp);
+                    if (i < 0x80) {
+                        if (i == EOF || i == '\n' || i == '\r')
+                            goto done;
+                    } else
+                        i = get_utf8_rest(f, i);
+                    out[n++] = i;
+                }
+                goto done;
+
+            case UTF16BE:
+            case UTF16LE:
+                while (n < room) {
+                    i = get_utf16_unit(f);
+                    if (i == EOF || i == '\n' || i == '\r')
+                        goto done;
+                    i = get_utf16_rest(f, i);
+                    out[n++] = i;
+                    if (f->savedChar != -1)
+                        break;
+                }
+                break;
+        }
+    }
+
+    while (n < room && (i = get_uni_c(f)) != EOF && i != '\n' && i != '\r')
+        out[n++] = i;
+done:
+    *len = n;
+    return i;
+}
+
 int
 input_line(UFILE* f)
 {
@@ -422,11 +560,7 @@ static uint32_t *utf32Buf = NULL;
                 if (utf32Buf == NULL)
                     utf32Buf = (uint32_t*) xcalloc(bufsize, sizeof(uint32_t));
                 tmpLen = 0;
-                if (i != EOF && i != '\n' && i != '\r')
-                    utf32Buf[tmpLen++] = i;
-                if (i != EOF && i != '\n' && i != '\r')
-                    while (tmpLen < bufsize && (i = get_uni_c(f)) != EOF && i != '\n' && i != '\r')
-                        utf32Buf[tmpLen++] = i;
+                i = read_uni_line(f, i, utf32Buf, &tmpLen, bufsize);
 
                 if (i == EOF && errno != EINTR && tmpLen == 0)
                     return false;
@@ -442,11 +576,9 @@ static uint32_t *utf32Buf = NULL;
                 if (f->encodingMode == WIN32CONSOLE && i == 0x1a) /* Ctrl+Z */
                     return false;
 #endif
-                if (last < bufsize && i != EOF && i != '\n' && i != '\r')
-                    buffer[last++] = i;
-                if (i != EOF && i != '\n' && i != '\r')
-                    while (last < bufsize && (i = get_uni_c(f)) != EOF && i != '\n' && i != '\r')
-                        buffer[last++] = i;
+                tmpLen = 0;
+                i = read_uni_line(f, i, (uint32_t*)&buffer[first], &tmpLen, bufsize - first);
+                last = first + tmpLen;
 
                 if (i == EOF && errno != EINTR && last == first)
                     return false;
@@ -480,50 +612,100 @@ static void die(const_string s, int i)
     exit(3);
 }
 
-static UBreakIterator* brkIter = NULL;
-static int brkLocaleStrNum = 0;
+/* Line break iterators are expensive to create (ICU loads the break rules
+   and dictionaries for the locale), so a few are kept open for documents
+   that switch \XeTeXlinebreaklocale back and forth, most recently used
+   first. */
+#define LINEBREAK_ITERATORS_KEPT 4
+
+static struct {
+    int localeStrNum;
+    UBreakIterator* iter;
+} brkIters[LINEBREAK_ITERATORS_KEPT];
+static int brkIterCount = 0;
+static UBreakIterator* brkIter = NULL; /* the one in use, or NULL for Graphite */
+
+static integer brkItersOpened = 0;
+static integer brkItersReused = 0;
+
+integer
+linebreakiteratorsopened(void)
+{
+    return brkItersOpened;
+}
+
+integer
+linebreakiteratorsreused(void)
+{
+    return brkItersReused;
+}
+
+static UBreakIterator*
+openlinebreakiterator(const char* locale)
+{
+    UErrorCode status = U_ZERO_ERROR;
+    UBreakIterator* iter = ubrk_open(UBRK_LINE, locale, NULL, 0, &status);
+    if (U_FAILURE(status)) {
+        begindiagnostic();
+        printnl('E');
+        printcstring("rror ");
+        printint(status);
+        printcstring(" creating linebreak iterator for locale `");
+        printcstring(locale);
+        printcstring("'; trying default locale `en_us'.");
+        enddiagnostic(1);
+        if (iter != NULL)
+            ubrk_close(iter);
+        status = U_ZERO_ERROR;
+        iter = ubrk_open(UBRK_LINE, "en_us", NULL, 0, &status);
+    }
+
+    if (iter == NULL) {
+        die("! failed to create linebreak iterator, status=%d", (int)status);
+    }
+
+    brkItersOpened++;
+    return iter;
+}
 
 void
 linebreakstart(int f, integer localeStrNum, uint16_t* text, integer textLength)
 {
     UErrorCode status = U_ZERO_ERROR;
     char* locale = (char*)gettexstring(localeStrNum);
+    int i;
 
     if (fontarea[f] == OTGR_FONT_FLAG && strcmp(locale, "G") == 0) {
         XeTeXLayoutEngine engine = (XeTeXLayoutEngine) fontlayoutengine[f];
-        if (initGraphiteBreaking(engine, text, textLength))
+        if (initGraphiteBreaking(engine, text, textLength)) {
             /* user asked for Graphite line breaking and the font supports it */
+            free(locale);
+            brkIter = NULL;
             return;
-    }
-
-    if ((localeStrNum != brkLocaleStrNum) && (brkIter != NULL)) {
-        ubrk_close(brkIter);
-        brkIter = NULL;
-    }
-
-    if (brkIter == NULL) {
-        brkIter = ubrk_open(UBRK_LINE, locale, NULL, 0, &status);
-        if (U_FAILURE(status)) {
-            begindiagnostic();
-            printnl('E');
-            printcstring("rror ");
-            printint(status);
-            printcstring(" creating linebreak iterator for locale `");
-            printcstring(locale);
-            printcstring("'; trying default locale `en_us'.");
-            enddiagnostic(1);
-            if (brkIter != NULL)
-                ubrk_close(brkIter);
-            status = U_ZERO_ERROR;
-            brkIter = ubrk_open(UBRK_LINE, "en_us", NULL, 0, &status);
         }
-        free(locale);
-        brkLocaleStrNum = localeStrNum;
     }
 
-    if (brkIter == NULL) {
-        die("! failed to create linebreak iterator, status=%d", (int)status);
+    for (i = 0; i < brkIterCount; i++)
+        if (brkIters[i].localeStrNum == localeStrNum)
+            break;
+
+    if (i < brkIterCount) {
+        brkIter = brkIters[i].iter;
+        brkItersReused++;
+    } else {
+        brkIter = openlinebreakiterator(locale);
+        if (brkIterCount < LINEBREAK_ITERATORS_KEPT)
+            brkIterCount++;
+        else
+            ubrk_close(brkIters[--i].iter);
     }
+    free(locale);
+
+    /* move it to the front */
+    for (; i > 0; i--)
+        brkIters[i] = brkIters[i - 1];
+    brkIters[0].localeStrNum = localeStrNum;
+    brkIters[0].iter = brkIter;
 
     ubrk_setText(brkIter, (UChar*) text, textLength, &status);
 }
@@ -1936,24 +2118,11 @@ get_native_glyph(void* pNode, unsigned index)
         return glyphIDs[index];
 }
 
-void
-store_justified_native_glyphs(void* pNode)
+static void
+justify_native_glyphs(memoryword* node, int savedWidth)
 {
-    memoryword* node = (memoryword*)pNode;
     unsigned f = native_font(node);
 
-#ifdef XETEX_MAC /* separate Mac-only codepath for AAT fonts */
-    if (fontarea[f] == AAT_FONT_FLAG) {
-        (void)DoAATLayout(node, 1);
-        return;
-    }
-#endif
-
-    /* save desired width */
-    int savedWidth = node_width(node);
-
-    measure_native_node(node, 0);
-
     if (node_width(node) != savedWidth) {
         /* see how much adjustment is needed overall */
         double justAmount = Fix2D(savedWidth - node_width(node));
@@ -1989,9 +2158,239 @@ store_justified_native_glyphs(void* pNode)
 }
 
 void
-measure_native_node(void* pNode, int use_glyph_metrics)
+store_justified_native_glyphs(void* pNode)
+{
+    memoryword* node = (memoryword*)pNode;
+
+#ifdef XETEX_MAC /* separate Mac-only codepath for AAT fonts */
+    unsigned f = native_font(node);
+    if (fontarea[f] == AAT_FONT_FLAG) {
+        (void)DoAATLayout(node, 1);
+        return;
+    }
+#endif
+
+    /* save desired width */
+    int savedWidth = node_width(node);
+
+    measure_native_node(node, 0);
+
+    justify_native_glyphs(node, savedWidth);
+}
+
+/* Scratch space for measure_native_node, kept from one call to the next so that
+   shaping a word (or each visual run of a mixed-direction word) does not need
+   any allocation beyond the node's own glyph info. */
+
+static UBiDi* pBiDi = NULL;
+
+static struct {
+    int         runAllocated;   /* per-run results from the layout engine */
+    uint32_t*   glyphs;
+    float*      advances;
+    FloatPoint* positions;
+    int         totalAllocated; /* accumulated results for the whole node */
+    uint16_t*   glyphIDs;
+    FixedPoint* locations;
+    Fixed*      glyphAdvances;
+} scratch = { 0, NULL, NULL, NULL, 0, NULL, NULL, NULL };
+
+static void
+grow_layout_scratch(int runCount, int totalCount)
+{
+    if (runCount + 1 > scratch.runAllocated) {
+        while (runCount + 1 > scratch.runAllocated)
+            scratch.runAllocated = scratch.runAllocated == 0 ? 256 : 2 * scratch.runAllocated;
+        scratch.glyphs = (uint32_t*) xrealloc(scratch.glyphs, scratch.runAllocated * sizeof(uint32_t));
+        scratch.advances = (float*) xrealloc(scratch.advances, scratch.runAllocated * sizeof(float));
+        scratch.positions = (FloatPoint*) xrealloc(scratch.positions, scratch.runAllocated * sizeof(FloatPoint));
+    }
+    if (totalCount > scratch.totalAllocated) {
+        while (totalCount > scratch.totalAllocated)
+            scratch.totalAllocated = scratch.totalAllocated == 0 ? 256 : 2 * scratch.totalAllocated;
+        scratch.glyphIDs = (uint16_t*) xrealloc(scratch.glyphIDs, scratch.totalAllocated * sizeof(uint16_t));
+        scratch.locations = (FixedPoint*) xrealloc(scratch.locations, scratch.totalAllocated * sizeof(FixedPoint));
+        scratch.glyphAdvances = (Fixed*) xrealloc(scratch.glyphAdvances, scratch.totalAllocated * sizeof(Fixed));
+    }
+}
+
+/* When hlist_out merges a run of words and inter-word spaces into one node,
+   the glyphs already shaped for the individual words can be reused instead of
+   shaping the whole run again, provided the font cannot substitute or position
+   the space glyph in context (see canReuseWordGlyphs). The caller feeds the
+   nodes of the run in order to append_merged_native_glyphs/_space and then
+   stores the result; if anything in the run is unsuitable, the store returns
+   false and the merged node must be shaped as usual. The layout engine joins
+   the words' unrounded glyph positions, so the result is exactly what shaping
+   the merged text would give. */
+
+enum { MERGE_INACTIVE, MERGE_AFTER_SPACE, MERGE_AFTER_WORD };
+
+static int          mergeState = MERGE_INACTIVE;
+static unsigned     mergeFont;
+
+boolean
+begin_merged_native_glyphs(void* pNode)
+{
+    memoryword* node = (memoryword*)pNode;
+    unsigned f = native_font(node);
+
+    mergeState = MERGE_INACTIVE;
+    if (fontarea[f] != OTGR_FONT_FLAG || fontletterspace[f] != 0)
+        return false;
+
+    if (!canReuseWordGlyphs((XeTeXLayoutEngine)(fontlayoutengine[f]),
+                            (uint16_t*)(node + native_node_size), native_length(node)))
+        return false;
+
+    mergeState = MERGE_AFTER_SPACE;
+    mergeFont = f;
+    beginMergedGlyphs((XeTeXLayoutEngine)(fontlayoutengine[f]));
+    return true;
+}
+
+void
+append_merged_native_glyphs(void* pNode)
+{
+    memoryword* node = (memoryword*)pNode;
+
+    /* words that touch without a space might interact, so need a real reshape */
+    if (mergeState != MERGE_AFTER_SPACE || native_font(node) != mergeFont) {
+        mergeState = MERGE_INACTIVE;
+        return;
+    }
+
+    appendMergedWord((XeTeXLayoutEngine)(fontlayoutengine[mergeFont]),
+                     (uint16_t*)(node + native_node_size), native_length(node));
+    mergeState = MERGE_AFTER_WORD;
+}
+
+void
+append_merged_native_space(void)
+{
+    if (mergeState != MERGE_AFTER_WORD) {
+        mergeState = MERGE_INACTIVE;
+        return;
+    }
+
+    appendMergedSpace((XeTeXLayoutEngine)(fontlayoutengine[mergeFont]));
+    mergeState = MERGE_AFTER_SPACE;
+}
+
+boolean
+store_merged_native_glyphs(void* pNode)
 {
     memoryword* node = (memoryword*)pNode;
+    void* glyph_info = NULL;
+    int savedWidth = node_width(node);
+    int nGlyphs, i;
+
+    if (mergeState != MERGE_AFTER_WORD) {
+        mergeState = MERGE_INACTIVE;
+        return false;
+    }
+    mergeState = MERGE_INACTIVE;
+
+    /* as measure_native_glyphs does for a single left-to-right run */
+    nGlyphs = endMergedGlyphs((XeTeXLayoutEngine)(fontlayoutengine[mergeFont]));
+    grow_layout_scratch(nGlyphs, nGlyphs);
+    getGlyphs((XeTeXLayoutEngine)(fontlayoutengine[mergeFont]), scratch.glyphs);
+    getGlyphPositions((XeTeXLayoutEngine)(fontlayoutengine[mergeFont]), scratch.positions);
+
+    if (nGlyphs > 0) {
+        FixedPoint* locations;
+        uint16_t* glyphIDs;
+        glyph_info = xcalloc(nGlyphs, native_glyph_info_size);
+        locations = (FixedPoint*)glyph_info;
+        glyphIDs = (uint16_t*)(locations + nGlyphs);
+        for (i = 0; i < nGlyphs; ++i) {
+            glyphIDs[i] = scratch.glyphs[i];
+            locations[i].x = D2Fix(scratch.positions[i].x);
+            locations[i].y = D2Fix(scratch.positions[i].y);
+        }
+        node_width(node) = D2Fix(scratch.positions[nGlyphs].x);
+    } else
+        node_width(node) = 0;
+
+    native_glyph_count(node) = nGlyphs;
+    native_glyph_info_ptr(node) = glyph_info;
+    node_height(node) = heightbase[mergeFont];
+    node_depth(node) = depthbase[mergeFont];
+
+    justify_native_glyphs(node, savedWidth);
+
+    return true;
+}
+
+/* Every discretionary that line_break makes in a native font gets a new
+   hyphen node, so each font keeps the measurements of its hyphen char to
+   copy into the next one. */
+static struct native_hyphen {
+    int         valid;
+    uint16_t    ch;
+    int         use_glyph_metrics;
+    Fixed       width, height, depth;
+    int         glyph_count;
+    void*       glyph_info;
+} *native_hyphens = NULL;
+static int native_hyphens_size = 0;
+
+static int
+copy_native_hyphen(memoryword* node, int use_glyph_metrics)
+{
+    unsigned f = native_font(node);
+    struct native_hyphen* h;
+
+    if (f >= native_hyphens_size)
+        return 0;
+    h = &native_hyphens[f];
+    if (!h->valid || h->ch != *(uint16_t*)(node + native_node_size) || h->use_glyph_metrics != use_glyph_metrics)
+        return 0;
+
+    node_width(node) = h->width;
+    node_height(node) = h->height;
+    node_depth(node) = h->depth;
+    native_glyph_count(node) = h->glyph_count;
+    if (h->glyph_count > 0) {
+        native_glyph_info_ptr(node) = xmalloc(h->glyph_count * native_glyph_info_size);
+        memcpy(native_glyph_info_ptr(node), h->glyph_info, h->glyph_count * native_glyph_info_size);
+    } else
+        native_glyph_info_ptr(node) = NULL;
+    return 1;
+}
+
+static void
+keep_native_hyphen(memoryword* node, int use_glyph_metrics)
+{
+    unsigned f = native_font(node);
+    struct native_hyphen* h;
+
+    if (f >= native_hyphens_size) {
+        int size = f + 16;
+        native_hyphens = (struct native_hyphen*) xrealloc(native_hyphens, size * sizeof(struct native_hyphen));
+        memset(native_hyphens + native_hyphens_size, 0, (size - native_hyphens_size) * sizeof(struct native_hyphen));
+        native_hyphens_size = size;
+    }
+    h = &native_hyphens[f];
+    free(h->glyph_info);
+    h->valid = 1;
+    h->ch = *(uint16_t*)(node + native_node_size);
+    h->use_glyph_metrics = use_glyph_metrics;
+    h->width = node_width(node);
+    h->height = node_height(node);
+    h->depth = node_depth(node);
+    h->glyph_count = native_glyph_count(node);
+    h->glyph_info = NULL;
+    if (h->glyph_count > 0) {
+        h->glyph_info = xmalloc(h->glyph_count * native_glyph_info_size);
+        memcpy(h->glyph_info, native_glyph_info_ptr(node), h->glyph_count * native_glyph_info_size);
+    }
+}
+
+static void
+measure_native_glyphs(memoryword* node, memoryword* parent, int start, int parentLen, int use_glyph_metrics)
+    /* measure node, which holds parent's text from start on if parent isn't NULL */
+{
     int txtLen = native_length(node);
     uint16_t* txtPtr = (uint16_t*)(node + native_node_size);
 
@@ -2017,111 +2416,62 @@ measure_native_node(void* pNode, int use_glyph_metrics)
 
         UBiDiDirection dir;
         void* glyph_info = 0;
-        static FloatPoint* positions = 0;
-        static float* advances = 0;
-        static uint32_t* glyphs = 0;
-
-        UBiDi* pBiDi = ubidi_open();
+        int nRuns, runIndex, i;
+        int32_t logicalStart, length;
+        double x = 0.0, y = 0.0;
 
         UErrorCode errorCode = U_ZERO_ERROR;
+        if (pBiDi == NULL)
+            pBiDi = ubidi_open();
         ubidi_setPara(pBiDi, (const UChar*) txtPtr, txtLen, getDefaultDirection(engine), NULL, &errorCode);
 
         dir = ubidi_getDirection(pBiDi);
-        if (dir == UBIDI_MIXED) {
-            /* we actually do the layout twice here, once to count glyphs and then again to get them;
-               which is inefficient, but i figure that MIXED is a relatively rare occurrence, so i can't be
-               bothered to deal with the memory reallocation headache of doing it differently
-            */
-            int nRuns = ubidi_countRuns(pBiDi, &errorCode);
-            double width = 0;
-            int i, runIndex;
-            int32_t logicalStart, length;
-            for (runIndex = 0; runIndex < nRuns; ++runIndex) {
-                dir = ubidi_getVisualRun(pBiDi, runIndex, &logicalStart, &length);
-                totalGlyphCount += layoutChars(engine, txtPtr, logicalStart, length, txtLen, (dir == UBIDI_RTL));
+        nRuns = (dir == UBIDI_MIXED) ? ubidi_countRuns(pBiDi, &errorCode) : 1;
+
+        /* shape each visual run once, appending its glyphs to the scratch arena */
+        for (runIndex = 0; runIndex < nRuns; ++runIndex) {
+            int nGlyphs;
+            UBiDiDirection runDir = dir;
+            logicalStart = 0;
+            length = txtLen;
+            if (dir == UBIDI_MIXED)
+                runDir = ubidi_getVisualRun(pBiDi, runIndex, &logicalStart, &length);
+            nGlyphs = -1;
+            if (parent != NULL && dir == UBIDI_LTR)
+                nGlyphs = layoutFragment(engine, (uint16_t*)(parent + native_node_size), parentLen, start, start + txtLen);
+            if (nGlyphs < 0)
+                nGlyphs = layoutChars(engine, txtPtr, logicalStart, length, txtLen, (runDir == UBIDI_RTL));
+
+            grow_layout_scratch(nGlyphs, totalGlyphCount + nGlyphs);
+
+            getGlyphs(engine, scratch.glyphs);
+            getGlyphAdvances(engine, scratch.advances);
+            getGlyphPositions(engine, scratch.positions);
+
+            for (i = 0; i < nGlyphs; ++i) {
+                scratch.glyphIDs[totalGlyphCount] = scratch.glyphs[i];
+                scratch.locations[totalGlyphCount].x = D2Fix(scratch.positions[i].x + x);
+                scratch.locations[totalGlyphCount].y = D2Fix(scratch.positions[i].y + y);
+                scratch.glyphAdvances[totalGlyphCount] = D2Fix(scratch.advances[i]);
+                ++totalGlyphCount;
             }
-
-            if (totalGlyphCount > 0) {
-                double x, y;
-                glyph_info = xcalloc(totalGlyphCount, native_glyph_info_size);
-                locations = (FixedPoint*)glyph_info;
-                glyphIDs = (uint16_t*)(locations + totalGlyphCount);
-                glyphAdvances = (Fixed*) xcalloc(totalGlyphCount, sizeof(Fixed));
-                totalGlyphCount = 0;
-
-                x = y = 0.0;
-                for (runIndex = 0; runIndex < nRuns; ++runIndex) {
-                    int nGlyphs;
-                    dir = ubidi_getVisualRun(pBiDi, runIndex, &logicalStart, &length);
-                    nGlyphs = layoutChars(engine, txtPtr, logicalStart, length, txtLen,
-                                            (dir == UBIDI_RTL));
-
-                    glyphs = (uint32_t*) xcalloc(nGlyphs, sizeof(uint32_t));
-                    positions = (FloatPoint*) xcalloc(nGlyphs + 1, sizeof(FloatPoint));
-                    advances = (float*) xcalloc(nGlyphs, sizeof(float));
-
-                    getGlyphs(engine, glyphs);
-                    getGlyphAdvances(engine, advances);
-                    getGlyphPositions(engine, positions);
-
-                    for (i = 0; i < nGlyphs; ++i) {
-                        glyphIDs[totalGlyphCount] = glyphs[i];
-                        locations[totalGlyphCount].x = D2Fix(positions[i].x + x);
-                        locations[totalGlyphCount].y = D2Fix(positions[i].y + y);
-                        glyphAdvances[totalGlyphCount] = D2Fix(advances[i]);
-                        ++totalGlyphCount;
-                    }
-                    x += positions[nGlyphs].x;
-                    y += positions[nGlyphs].y;
-
-                    free(glyphs);
-                    free(positions);
-                    free(advances);
-                }
-                width = x;
-            }
-
-            node_width(node) = D2Fix(width);
-            native_glyph_count(node) = totalGlyphCount;
-            native_glyph_info_ptr(node) = glyph_info;
-        } else {
-            double width = 0;
-            totalGlyphCount = layoutChars(engine, txtPtr, 0, txtLen, txtLen, (dir == UBIDI_RTL));
-
-            glyphs = (uint32_t*) xcalloc(totalGlyphCount, sizeof(uint32_t));
-            positions = (FloatPoint*) xcalloc(totalGlyphCount + 1, sizeof(FloatPoint));
-            advances = (float*) xcalloc(totalGlyphCount, sizeof(float));
-
-            getGlyphs(engine, glyphs);
-            getGlyphAdvances(engine, advances);
-            getGlyphPositions(engine, positions);
-
-            if (totalGlyphCount > 0) {
-                int i;
-                glyph_info = xcalloc(totalGlyphCount, native_glyph_info_size);
-                locations = (FixedPoint*)glyph_info;
-                glyphIDs = (uint16_t*)(locations + totalGlyphCount);
-                glyphAdvances = (Fixed*) xcalloc(totalGlyphCount, sizeof(Fixed));
-                for (i = 0; i < totalGlyphCount; ++i) {
-                    glyphIDs[i] = glyphs[i];
-                    glyphAdvances[i] = D2Fix(advances[i]);
-                    locations[i].x = D2Fix(positions[i].x);
-                    locations[i].y = D2Fix(positions[i].y);
-                }
-                width = positions[totalGlyphCount].x;
-            }
-
-            node_width(node) = D2Fix(width);
-            native_glyph_count(node) = totalGlyphCount;
-            native_glyph_info_ptr(node) = glyph_info;
-
-            free(glyphs);
-            free(positions);
-            free(advances);
+            x += scratch.positions[nGlyphs].x;
+            y += scratch.positions[nGlyphs].y;
         }
 
-        ubidi_close(pBiDi);
+        if (totalGlyphCount > 0) {
+            glyph_info = xcalloc(totalGlyphCount, native_glyph_info_size);
+            locations = (FixedPoint*)glyph_info;
+            glyphIDs = (uint16_t*)(locations + totalGlyphCount);
+            memcpy(locations, scratch.locations, totalGlyphCount * sizeof(FixedPoint));
+            memcpy(glyphIDs, scratch.glyphIDs, totalGlyphCount * sizeof(uint16_t));
+            glyphAdvances = scratch.glyphAdvances;
+        } else
+            x = 0.0;
 
+        node_width(node) = D2Fix(x);
+        native_glyph_count(node) = totalGlyphCount;
+        native_glyph_info_ptr(node) = glyph_info;
 
         if (fontletterspace[f] != 0) {
             Fixed lsDelta = 0;
@@ -2138,7 +2488,6 @@ measure_native_node(void* pNode, int use_glyph_metrics)
                 node_width(node) += lsDelta;
             }
         }
-        free(glyphAdvances);
     } else {
         fprintf(stderr, "\n! Internal error: bad native font flag in `measure_native_node'\n");
         exit(3);
@@ -2163,15 +2512,19 @@ measure_native_node(void* pNode, int use_glyph_metrics)
 
             GlyphBBox bbox;
             if (getCachedGlyphBBox(f, glyphIDs[i], &bbox) == 0) {
+                unsigned int numGlyphs = 0;
 #ifdef XETEX_MAC
                 if (fontarea[f] == AAT_FONT_FLAG)
                     GetGlyphBBox_AAT((CFDictionaryRef)(fontlayoutengine[f]), glyphIDs[i], &bbox);
                 else
 #endif
-                if (fontarea[f] == OTGR_FONT_FLAG)
-                    getGlyphBounds((XeTeXLayoutEngine)(fontlayoutengine[f]), glyphIDs[i], &bbox);
+                if (fontarea[f] == OTGR_FONT_FLAG) {
+                    XeTeXLayoutEngine engine = (XeTeXLayoutEngine)(fontlayoutengine[f]);
+                    getGlyphBounds(engine, glyphIDs[i], &bbox);
+                    numGlyphs = countGlyphs(getFont(engine));
+                }
 
-                cacheGlyphBBox(f, glyphIDs[i], &bbox);
+                cacheGlyphBBox(f, glyphIDs[i], numGlyphs, &bbox);
             }
 
             ht = bbox.yMax;
@@ -2187,6 +2540,28 @@ measure_native_node(void* pNode, int use_glyph_metrics)
     }
 }
 
+void
+measure_native_node(void* pNode, int use_glyph_metrics)
+{
+    memoryword* node = (memoryword*)pNode;
+    int is_hyphen = native_length(node) == 1
+        && *(uint16_t*)(node + native_node_size) == hyphenchar[native_font(node)];
+
+    if (is_hyphen && copy_native_hyphen(node, use_glyph_metrics))
+        return;
+    measure_native_glyphs(node, NULL, 0, 0, use_glyph_metrics);
+    if (is_hyphen)
+        keep_native_hyphen(node, use_glyph_metrics);
+}
+
+void
+measure_native_fragment(void* pNode, void* pParent, int start, int parentLen, int use_glyph_metrics)
+{
+    /* the fragment of a word that line_break cuts off at a hyphenation point
+       or at punctuation can usually share the glyphs of the whole word */
+    measure_native_glyphs((memoryword*)pNode, (memoryword*)pParent, start, parentLen, use_glyph_metrics);
+}
+
 Fixed
 get_native_italic_correction(void* pNode)
 {
@@ -2630,11 +3005,123 @@ Isspace(char c)
 }
 #endif
 
+/* Output on its way to the driver goes through a large stdio buffer, so
+   that it reaches the pipe or file in a few big writes rather than in
+   dvi_buf_size/2 pieces.  With xdv_tempfile set in texmf.cnf, the XDV is
+   written to a file next to the PDF instead of a pipe, and the driver is
+   run on that file once it is complete; xdvipdfmx needs the postamble
+   before it can start, so it would otherwise copy the whole stream from
+   the pipe to a temporary file of its own first.  */
+#define DVI_DRIVER_BUFFER_SIZE 262144
+static char *dvi_driver_buffer;
+#ifndef WIN32
+static char *dvi_driver_command;
+static char *dvi_driver_input;
+
+static char *
+append_quoted(char *cmd, const char *name)
+{
+    const char *p;
+    char *q, *result;
+    int len = strlen(cmd) + strlen(name) + 4;
+
+    for (p = name; *p; p++)
+        if (*p == '\"')
+            ++len;
+    result = xmalloc(len);
+    strcpy(result, cmd);
+    q = result + strlen(result);
+    *q++ = '\"';
+    for (p = name; *p; p++) {
+        if (*p == '\"')
+            *q++ = '\\';
+        *q++ = *p;
+    }
+    *q++ = '\"';
+    *q = '\0';
+    return result;
+}
+#endif
+
+/* With xdv_index set, a -no-pdf run also writes FILE.xdvidx beside
+   FILE.xdv, so that a driver can split the pages among several workers
+   without first reading the XDV through.  It holds one line per event,
+   with offsets into the XDV:
+       f FONT OFFSET    FONT is first defined at OFFSET
+       i PATH           the current page includes the picture PATH
+       p N BOP END      page N runs from BOP up to END; then the fonts
+                        that it selects
+   FONT is the number the XDV gives the font in its fnt_def and fnt
+   commands.  Font definitions come before the first page that uses
+   them, as they do in the XDV itself.  */
+static FILE *xdv_index_file;
+static int *xdv_index_fonts;
+static int xdv_index_font_count, xdv_index_font_size;
+
+static void
+xdv_index_open(void)
+{
+    char *value = kpse_var_value("xdv_index");
+    if (value && (*value == 't' || *value == 'y' || *value == '1')) {
+        char *name = concat((const char*)nameoffile+1, "idx");
+        xdv_index_file = fopen(name, FOPEN_W_MODE);
+        if (xdv_index_file)
+            fputs("% XDV page index, version 1\n", xdv_index_file);
+        else
+            fprintf(stderr, "\nxetex: can't write %s\n", name);
+        free(name);
+    }
+    free(value);
+}
+
+void
+xdv_index_font(int f, int used, int loc)
+{
+    int i;
+
+    if (!xdv_index_file)
+        return;
+    if (!used)
+        fprintf(xdv_index_file, "f %d %d\n", f, loc);
+    for (i = 0; i < xdv_index_font_count; i++)
+        if (xdv_index_fonts[i] == f)
+            return;
+    if (xdv_index_font_count == xdv_index_font_size) {
+        xdv_index_font_size += 16;
+        xdv_index_fonts = xrealloc(xdv_index_fonts, xdv_index_font_size * sizeof(int));
+    }
+    xdv_index_fonts[xdv_index_font_count++] = f;
+}
+
+void
+xdv_index_page(int n, int bop, int end)
+{
+    int i;
+
+    if (!xdv_index_file)
+        return;
+    fprintf(xdv_index_file, "p %d %d %d", n, bop, end);
+    for (i = 0; i < xdv_index_font_count; i++)
+        fprintf(xdv_index_file, " %d", xdv_index_fonts[i]);
+    putc('\n', xdv_index_file);
+    xdv_index_font_count = 0;
+}
+
+void
+xdv_index_pic(const char* path, int len)
+{
+    if (xdv_index_file)
+        fprintf(xdv_index_file, "i %.*s\n", len, path);
+}
+
 int
 open_dvi_output(FILE** fptr)
 {
     if (nopdfoutput) {
-        return open_output(fptr, FOPEN_WBIN_MODE);
+        if (!open_output(fptr, FOPEN_WBIN_MODE))
+            return 0;
+        xdv_index_open();
+        return 1;
     } else {
         const char *p = (const char*)nameoffile+1;
         char    *cmd, *q, *bindir = NULL;
@@ -2722,9 +3209,34 @@ open_dvi_output(FILE** fptr)
             free(tmp1w);
         }
 #else
-        *fptr = popen(cmd, "w");
+        {
+            char *value = kpse_var_value("xdv_tempfile");
+            if (value && (*value == 't' || *value == 'y' || *value == '1')) {
+                char pid_str[MAX_INT_LENGTH];
+                char *base = xstrdup((const char*)nameoffile+1);
+                char *dot = strrchr(base, '.');
+                if (dot && !strchr(dot, '/'))
+                    *dot = '\0';
+                sprintf(pid_str, ".%ld", (long) getpid());
+                dvi_driver_input = concat3(base, pid_str, ".xdv");
+                free(base);
+                *fptr = fopen(dvi_driver_input, FOPEN_WBIN_MODE);
+                if (*fptr) {
+                    dvi_driver_command = concat(cmd, " ");
+                } else {
+                    free(dvi_driver_input);
+                    dvi_driver_input = NULL;
+                }
+            } else
+                *fptr = popen(cmd, "w");
+            free(value);
+        }
 #endif
         free(cmd);
+        if (*fptr) {
+            dvi_driver_buffer = xmalloc(DVI_DRIVER_BUFFER_SIZE);
+            setvbuf(*fptr, dvi_driver_buffer, _IOFBF, DVI_DRIVER_BUFFER_SIZE);
+        }
         return (*fptr != 0);
     }
 }
@@ -2732,20 +3244,42 @@ open_dvi_output(FILE** fptr)
 int
 dviclose(FILE* fptr)
 {
+    int rval = 0;
+
     if (nopdfoutput) {
+        if (xdv_index_file) {
+            fclose(xdv_index_file);
+            xdv_index_file = NULL;
+        }
         if (fclose(fptr) != 0)
             return errno;
     } else {
-        return pclose(fptr);
+#ifndef WIN32
+        if (dvi_driver_input) {
+            if (fclose(fptr) != 0)
+                rval = errno;
+            else {
+                char *cmd = append_quoted(dvi_driver_command, dvi_driver_input);
+                rval = system(cmd);
+                free(cmd);
+            }
+            unlink(dvi_driver_input);
+            free(dvi_driver_input);
+            free(dvi_driver_command);
+            dvi_driver_input = NULL;
+        } else
+#endif
+        rval = pclose(fptr);
+        free(dvi_driver_buffer);
+        dvi_driver_buffer = NULL;
     }
-    return 0;
+    return rval;
 }
 
 int
 get_uni_c(UFILE* f)
 {
     int rval;
-    int c;
 #ifdef WIN32
     HANDLE hStdin;
     DWORD ret;
@@ -2760,70 +3294,16 @@ get_uni_c(UFILE* f)
 
     switch (f->encodingMode) {
         case UTF8:
-            c = rval = GETC(f->f);
-            if (rval != EOF) {
-                uint16_t extraBytes = bytesFromUTF8[rval];
-                switch (extraBytes) {   /* note: code falls through cases! */
-                    case 3: c = GETC(f->f);
-                        if (c < 0x80 || c >= 0xc0) goto bad_utf8;
-                        rval <<= 6; rval += c;
-                    case 2: c = GETC(f->f);
-                        if (c < 0x80 || c >= 0xc0) goto bad_utf8;
-                        rval <<= 6; rval += c;
-                    case 1: c = GETC(f->f);
-                        if (c < 0x80 || c >= 0xc0) goto bad_utf8;
-                        rval <<= 6; rval += c;
-                    case 0:
-                        break;
-
-                    bad_utf8:
-                        if (c != EOF)
-                            UNGETC(c, f->f);
-                    case 5:
-                    case 4:
-                        badutf8warning();
-                        return 0xfffd;      /* return without adjusting by offsetsFromUTF8 */
-                };
-                rval -= offsetsFromUTF8[extraBytes];
-            }
-            break;
-
-        case UTF16BE:
             rval = GETC(f->f);
-            if (rval != EOF) {
-                rval <<= 8;
-                rval += GETC(f->f);
-                if (rval >= 0xd800 && rval <= 0xdbff) {
-                    int lo = GETC(f->f);
-                    lo <<= 8;
-                    lo += GETC(f->f);
-                    if (lo >= 0xdc00 && lo <= 0xdfff)
-                        rval = 0x10000 + (rval - 0xd800) * 0x400 + (lo - 0xdc00);
-                    else {
-                        rval = 0xfffd;
-                        f->savedChar = lo;
-                    }
-                } else if (rval >= 0xdc00 && rval <= 0xdfff)
-                    rval = 0xfffd;
-            }
+            if (rval != EOF)
+                rval = get_utf8_rest(f, rval);
             break;
 
+        case UTF16BE:
         case UTF16LE:
-            rval = GETC(f->f);
-            if (rval != EOF) {
-                rval += (GETC(f->f) << 8);
-                if (rval >= 0xd800 && rval <= 0xdbff) {
-                    int lo = GETC(f->f);
-                    lo += (GETC(f->f) << 8);
-                    if (lo >= 0xdc00 && lo <= 0xdfff)
-                        rval = 0x10000 + (rval - 0xd800) * 0x400 + (lo - 0xdc00);
-                    else {
-                        rval = 0xfffd;
-                        f->savedChar = lo;
-                    }
-                } else if (rval >= 0xdc00 && rval <= 0xdfff)
-                    rval = 0xfffd;
-            }
+            rval = get_utf16_unit(f);
+            if (rval != EOF)
+                rval = get_utf16_rest(f, rval);
             break;
 
 #ifdef WIN32
@@ -2928,3 +3408,47 @@ integer get_native_word_cp(void* pNode, int side)
     }
     return get_cp_code(f, actual_glyph, side);
 }
+
+/* The \lpcode and \rpcode tables are kept in hz.cpp; these write them into
+   the format file and read them back, one page of codes at a time. */
+
+#define CP_PAGE_SIZE 256
+#define CP_PAGE_MAX  (0x110000 / CP_PAGE_SIZE)
+
+void dump_cp_codes(void)
+{
+    int n = cp_code_page_count();
+    int i, fontNum, side;
+    unsigned int page;
+
+    dumpint(n);
+    for (i = 0; i < n; i++) {
+        const int* values = get_cp_code_page(i, &fontNum, &side, &page);
+        dumpint(fontNum);
+        dumpint(side);
+        dumpint(page);
+        dumpthings(values[0], CP_PAGE_SIZE);
+    }
+}
+
+boolean undump_cp_codes(void)
+{
+    int n, i, fontNum, side, page;
+    int values[CP_PAGE_SIZE];
+
+    undumpint(n);
+    if (n < 0)
+        return false;
+    for (i = 0; i < n; i++) {
+        undumpint(fontNum);
+        undumpint(side);
+        undumpint(page);
+        if (fontNum < 0 || fontNum > fontmax
+            || (side != LEFT_SIDE && side != RIGHT_SIDE)
+            || page < 0 || page >= CP_PAGE_MAX)
+            return false;
+        undumpthings(values[0], CP_PAGE_SIZE);
+        set_cp_code_page(fontNum, side, page, values);
+    }
+    return true;
+}
@@ -199,6 +199,8 @@ extern "C" {
     void uclose(unicodefile f);
     void linebreakstart(int f, integer localeStrNum, uint16_t* text, integer textLength);
     int linebreaknext(void);
+    integer linebreakiteratorsopened(void);
+    integer linebreakiteratorsreused(void);
     int getencodingmodeandinfo(integer* info);
     void printutf8str(const unsigned char* str, int len);
     void printchars(const unsigned short* str, int len);
@@ -227,7 +229,12 @@ extern "C" {
     int makefontdef(integer f);
     int applymapping(void* cnv, uint16_t* txtPtr, int txtLen);
     void store_justified_native_glyphs(void* node);
+    boolean begin_merged_native_glyphs(void* node);
+    void append_merged_native_glyphs(void* node);
+    void append_merged_native_space(void);
+    boolean store_merged_native_glyphs(void* node);
     void measure_native_node(void* node, int use_glyph_metrics);
+    void measure_native_fragment(void* node, void* parent, int start, int parentLen, int use_glyph_metrics);
     Fixed get_native_italic_correction(void* node);
     Fixed get_native_glyph_italic_correction(void* node);
     integer get_native_word_cp(void* node, int side);
@@ -250,6 +257,9 @@ extern "C" {
     int u_open_in(unicodefile* f, integer filefmt, const char* fopen_mode, integer mode, integer encodingData);
     int open_dvi_output(FILE** fptr);
     int dviclose(FILE* fptr);
+    void xdv_index_font(int f, int used, int loc);
+    void xdv_index_page(int n, int bop, int end);
+    void xdv_index_pic(const char* path, int len);
     int get_uni_c(UFILE* f);
     int input_line(UFILE* f);
     void makeutf16name(void);
@@ -276,6 +286,11 @@ typedef void* CFDictionaryRef; /* dummy declaration just so the stubs can compil
 
     void set_cp_code(int fontNum, unsigned int code, int side, int value);
     int get_cp_code(int fontNum, unsigned int code, int side);
+    int cp_code_page_count(void);
+    const int* get_cp_code_page(int n, int* fontNum, int* side, unsigned int* page);
+    void set_cp_code_page(int fontNum, int side, unsigned int page, const int* values);
+    void dump_cp_codes(void);
+    boolean undump_cp_codes(void);
 
 #ifdef XETEX_MAC
 
@@ -46,6 +46,7 @@ XeTeX_pic.c
 #include <kpathsea/readable.h>
 #include <kpathsea/variable.h>
 #include <kpathsea/absolute.h>
+#include <kpathsea/c-stat.h>
 
 #include "pdfimage.h"
 #include "image/pngimage.h"
@@ -53,14 +54,168 @@ XeTeX_pic.c
 #include "image/bmpimage.h"
 
 
+/*
+	Documents tend to use the same pictures over and over (a logo on every
+	page, or \XeTeXpdffile on each page of one PDF in turn), so the sizes
+	read from a file are kept, keyed by the file's size and modification
+	time as well as its path so that a file rewritten during the run is
+	read again.  (kpse_find_file keeps the answers to the name lookups.)
+
+	If the texmf.cnf variable xetex_pic_cache names a file, the sizes are
+	also appended to it, one per line, and read back by later runs:
+		KIND PAGE SIZE MTIME COUNT X Y WD HT PATH
+	where KIND is 0 for a bitmap, the pdf box type, or -1 for the number of
+	pages of a PDF (then in COUNT).  Lines for old versions of a file are
+	never matched again; delete the file to clean it up.
+*/
+#define PIC_PAGE_COUNT	-1
+#define PIC_HASH_SIZE	1021
+
+typedef struct pic_info {
+	struct pic_info*	next;
+	char*		path;
+	long long	size;
+	long long	mtime;
+	int			kind;
+	int			page;
+	int			count;
+	realrect	bounds;
+} pic_info;
+
+static pic_info*	pic_infos[PIC_HASH_SIZE];
+static FILE*		pic_cache_file;
+static int			pic_cache_loaded;
+
+static unsigned
+pic_hash(const char* s, int kind, int page)
+{
+	unsigned	h = kind * 31 + page;
+	while (*s)
+		h = h * 33 + (unsigned char)*s++;
+	return h % PIC_HASH_SIZE;
+}
+
+static pic_info*
+pic_info_lookup(const char* path, long long size, long long mtime, int kind, int page)
+{
+	pic_info*	p;
+	for (p = pic_infos[pic_hash(path, kind, page)]; p != NULL; p = p->next)
+		if (p->kind == kind && p->page == page && p->size == size
+				&& p->mtime == mtime && strcmp(p->path, path) == 0)
+			return p;
+	return NULL;
+}
+
+static pic_info*
+pic_info_add(const char* path, long long size, long long mtime, int kind, int page)
+{
+	unsigned	h = pic_hash(path, kind, page);
+	pic_info*	p = (pic_info*) xcalloc(1, sizeof(pic_info));
+	p->path = xstrdup(path);
+	p->size = size;
+	p->mtime = mtime;
+	p->kind = kind;
+	p->page = page;
+	p->next = pic_infos[h];
+	pic_infos[h] = p;
+	return p;
+}
+
+static void
+pic_cache_load(void)
+{
+	char*	name;
+
+	pic_cache_loaded = 1;
+	name = kpse_var_value("xetex_pic_cache");
+	if (name == NULL)
+		return;
+	if (*name != '\0') {
+		FILE*	f = fopen(name, FOPEN_R_MODE);
+		if (f != NULL) {
+			char*	line;
+			while ((line = read_line(f)) != NULL) {
+				int			kind, page, count, n;
+				long long	size, mtime;
+				realrect	r;
+				if (sscanf(line, "%d %d %lld %lld %d %g %g %g %g %n", &kind, &page,
+						&size, &mtime, &count, &r.x, &r.y, &r.wd, &r.ht, &n) == 9
+						&& line[n] != '\0'
+						&& pic_info_lookup(line + n, size, mtime, kind, page) == NULL) {
+					pic_info*	p = pic_info_add(line + n, size, mtime, kind, page);
+					p->count = count;
+					p->bounds = r;
+				}
+				free(line);
+			}
+			fclose(f);
+		}
+		pic_cache_file = fopen(name, FOPEN_A_MODE);
+		if (pic_cache_file == NULL)
+			fprintf(stderr, "\nxetex: can't write %s\n", name);
+	}
+	free(name);
+}
+
+static void
+pic_cache_save(const pic_info* p)
+{
+	if (pic_cache_file == NULL)
+		return;
+	fprintf(pic_cache_file, "%d %d %lld %lld %d %.9g %.9g %.9g %.9g %s\n", p->kind, p->page,
+			p->size, p->mtime, p->count, p->bounds.x, p->bounds.y, p->bounds.wd, p->bounds.ht, p->path);
+	fflush(pic_cache_file);
+}
+
+/* the cached facts about page /page/ of /path/ of the given kind, or NULL;
+   the size and time of the file are left in *size and *mtime */
+static pic_info*
+find_pic_info(const char* path, int kind, int page, long long* size, long long* mtime)
+{
+	struct stat	st;
+
+	if (!pic_cache_loaded)
+		pic_cache_load();
+	if (stat(path, &st) != 0) {
+		*size = *mtime = -1;
+		return NULL;
+	}
+	*size = st.st_size;
+	*mtime = st.st_mtime;
+	return pic_info_lookup(path, *size, *mtime, kind, page);
+}
+
+static void
+remember_pic_info(const char* path, long long size, long long mtime, int kind, int page,
+		int count, const realrect* bounds)
+{
+	pic_info*	p;
+
+	if (size < 0)
+		return;
+	p = pic_info_add(path, size, mtime, kind, page);
+	p->count = count;
+	if (bounds != NULL)
+		p->bounds = *bounds;
+	pic_cache_save(p);
+}
+
 int
 countpdffilepages(void)
 {
 	int	rval = 0;
 
-    char*		pic_path = kpse_find_file((char*)nameoffile + 1, kpse_pict_format, 1);
+	char*		pic_path = kpse_find_file((char*)nameoffile + 1, kpse_pict_format, 1);
 	if (pic_path) {
-		rval = pdf_count_pages(pic_path);
+		long long	size, mtime;
+		pic_info*	p = find_pic_info(pic_path, PIC_PAGE_COUNT, 0, &size, &mtime);
+		if (p != NULL)
+			rval = p->count;
+		else {
+			rval = pdf_count_pages(pic_path);
+			if (rval > 0)
+				remember_pic_info(pic_path, size, mtime, PIC_PAGE_COUNT, 0, rval, NULL);
+		}
 		free(pic_path);
 	}
 
@@ -81,7 +236,9 @@ find_pic_file(char** path, realrect* bounds, int pdfBoxType, int page)
 {
 	int		err = -1;
 	FILE*	fp = NULL;
-    char*	pic_path = kpse_find_file((char*)nameoffile + 1, kpse_pict_format, 1);
+	char*	pic_path = kpse_find_file((char*)nameoffile + 1, kpse_pict_format, 1);
+	long long	size, mtime;
+	pic_info*	info = NULL;
 
 	*path = NULL;
 	bounds->x = bounds->y = bounds->wd = bounds->ht = 0.0;
@@ -89,6 +246,15 @@ find_pic_file(char** path, realrect* bounds, int pdfBoxType, int page)
 	if (pic_path == NULL)
 		goto done;
 
+	if (pdfBoxType == 0)
+		page = 0;
+	info = find_pic_info(pic_path, pdfBoxType, page, &size, &mtime);
+	if (info != NULL) {
+		*bounds = info->bounds;
+		err = 0;
+		goto done;
+	}
+
 	/* if cmd was \XeTeXpdffile, use xpdflib to read it */
 	if (pdfBoxType != 0) {
 		err = pdf_get_rect(pic_path, page, pdfBoxType, bounds);
@@ -136,6 +302,9 @@ done:
 	if (fp != NULL)
 		fclose(fp);
 
+	if (err == 0 && info == NULL)
+		remember_pic_info(pic_path, size, mtime, pdfBoxType, page, 0, bounds);
+
 	if (err == 0)
 		*path = pic_path;
 	else {
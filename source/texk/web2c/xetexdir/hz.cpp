@@ -31,47 +31,112 @@ authorization from the copyright holders.
 
 #include "XeTeX_web.h"
 
-#include <map>
-#include <iostream>
+#include <vector>
+#include <string.h>
 #include <assert.h>
 using namespace std;
 
-typedef pair<int, unsigned int> GlyphId;
-typedef map<GlyphId, int>  ProtrusionFactor;
-ProtrusionFactor leftProt, rightProt;
+// Protrusion codes are looked up for every character at both ends of every
+// line that line_break considers, so they are kept in flat per-font tables
+// rather than a map: codes are split into pages of CP_PAGE_SIZE entries, and
+// a page is only allocated once some code in it has been set.
+
+#define CP_PAGE_BITS    8
+#define CP_PAGE_SIZE    (1 << CP_PAGE_BITS)
+
+struct ProtrusionTable {
+    vector<int*> pages[2];      // indexed by side, then by code >> CP_PAGE_BITS
+};
+
+static vector<ProtrusionTable*> protrusionTables;   // indexed by font number
 
 void set_cp_code(int fontNum, unsigned int code, int side, int value)
 {
-    GlyphId id(fontNum, code);
-    switch (side) {
-    case LEFT_SIDE:
-        leftProt[id] = value;
-        break;
-    case RIGHT_SIDE:
-        rightProt[id] = value;
-        break;
-    default:
-        assert(0); // we should not reach here
+    assert(side == LEFT_SIDE || side == RIGHT_SIDE);
+    assert(fontNum >= 0);
+
+    if ((unsigned int)fontNum >= protrusionTables.size())
+        protrusionTables.resize(fontNum + 1, NULL);
+    ProtrusionTable* table = protrusionTables[fontNum];
+    if (table == NULL) {
+        if (value == 0)
+            return;
+        table = protrusionTables[fontNum] = new ProtrusionTable;
+    }
+
+    vector<int*>& pages = table->pages[side];
+    unsigned int page = code >> CP_PAGE_BITS;
+    if (page >= pages.size()) {
+        if (value == 0)
+            return;
+        pages.resize(page + 1, NULL);
     }
+    if (pages[page] == NULL) {
+        if (value == 0)
+            return;
+        pages[page] = new int[CP_PAGE_SIZE];
+        memset(pages[page], 0, CP_PAGE_SIZE * sizeof(int));
+    }
+    pages[page][code & (CP_PAGE_SIZE - 1)] = value;
 }
 
 int get_cp_code(int fontNum, unsigned int code, int side)
 {
-    GlyphId id(fontNum, code);
-    ProtrusionFactor* container;
-    switch (side) {
-    case LEFT_SIDE:
-        container = &leftProt;
-        break;
-    case RIGHT_SIDE:
-        container = &rightProt;
-        break;
-    default:
-        assert(0); // we should not reach here
-    }
-    ProtrusionFactor::iterator it = container->find(id);
-    if (it == container->end())
+    if ((unsigned int)fontNum >= protrusionTables.size())
+        return 0;
+    const ProtrusionTable* table = protrusionTables[fontNum];
+    if (table == NULL)
+        return 0;
+
+    const vector<int*>& pages = table->pages[side];
+    unsigned int page = code >> CP_PAGE_BITS;
+    if (page >= pages.size() || pages[page] == NULL)
         return 0;
-    return it->second;
+    return pages[page][code & (CP_PAGE_SIZE - 1)];
 }
 
+// Access to the allocated pages for \dump: the pages are visited in order of
+// font number, side and page number, so that a format reloads them in the
+// same order.
+
+int cp_code_page_count(void)
+{
+    int count = 0;
+    for (unsigned int f = 0; f < protrusionTables.size(); f++) {
+        if (protrusionTables[f] == NULL)
+            continue;
+        for (int side = LEFT_SIDE; side <= RIGHT_SIDE; side++) {
+            const vector<int*>& pages = protrusionTables[f]->pages[side];
+            for (unsigned int page = 0; page < pages.size(); page++)
+                if (pages[page] != NULL)
+                    count++;
+        }
+    }
+    return count;
+}
+
+const int* get_cp_code_page(int n, int* fontNum, int* side, unsigned int* page)
+{
+    for (unsigned int f = 0; f < protrusionTables.size(); f++) {
+        if (protrusionTables[f] == NULL)
+            continue;
+        for (int s = LEFT_SIDE; s <= RIGHT_SIDE; s++) {
+            const vector<int*>& pages = protrusionTables[f]->pages[s];
+            for (unsigned int p = 0; p < pages.size(); p++) {
+                if (pages[p] == NULL || n-- > 0)
+                    continue;
+                *fontNum = f;
+                *side = s;
+                *page = p;
+                return pages[p];
+            }
+        }
+    }
+    return NULL;
+}
+
+void set_cp_code_page(int fontNum, int side, unsigned int page, const int* values)
+{
+    for (unsigned int i = 0; i < CP_PAGE_SIZE; i++)
+        set_cp_code(fontNum, (page << CP_PAGE_BITS) + i, side, values[i]);
+}
@@ -39,9 +39,12 @@ authorization from the copyright holders.
 #include "PDFDoc.h"
 #include "Catalog.h"
 #include "Page.h"
+#include "Hints.h"
 
 #include "XeTeX_ext.h"
 
+#include <kpathsea/c-stat.h>
+
 /* use our own fmin function because it seems to be missing on certain platforms */
 inline double
 my_fmin(double x, double y)
@@ -49,61 +52,289 @@ my_fmin(double x, double y)
 	return (x < y) ? x : y;
 }
 
-int
-pdf_get_rect(char* filename, int page_num, int pdf_box, realrect* box)
-	/* return the box converted to TeX points */
+/* Placing the pages of a PDF one by one would otherwise read its xref and
+   catalog again for every page, so the last few documents opened are kept,
+   most recently used first, along with the size and time of the file they
+   were read from. */
+#define PDF_DOCS_KEPT 4
+
+static struct {
+	char*		filename;
+	off_t		size;
+	time_t		mtime;
+	PDFDoc*		doc;
+	Hints*		hints;		/* linearization hints, once read */
+	bool		hintsRead;
+} pdfDocs[PDF_DOCS_KEPT];
+static int pdfDocCount = 0;
+
+static PDFDoc*
+pdf_open_doc(const char* filename)
 {
-	GooString*	name = new GooString(filename);
-	PDFDoc*		doc = new PDFDoc(name);
+	struct stat	st;
+	int			i;
 
-	if (!doc) {
-		delete name;
-		return -1;
+	if (stat(filename, &st) != 0)
+		return NULL;
+
+	for (i = 0; i < pdfDocCount; i++)
+		if (strcmp(pdfDocs[i].filename, filename) == 0)
+			break;
+	if (i < pdfDocCount && (pdfDocs[i].size != st.st_size || pdfDocs[i].mtime != st.st_mtime)) {
+		/* the file has changed since we read it */
+		delete pdfDocs[i].hints;
+		delete pdfDocs[i].doc;
+		free(pdfDocs[i].filename);
+		pdfDocCount--;
+		for (; i < pdfDocCount; i++)
+			pdfDocs[i] = pdfDocs[i + 1];
+	}
+
+	if (i == pdfDocCount) {
+		GooString*	name = new GooString(filename);
+		PDFDoc*		doc = new PDFDoc(name);
+
+		if (!doc) {
+			delete name;
+			return NULL;
+		}
+
+		/* if the doc got created, it now owns name, so we mustn't delete it! */
+
+		if (!doc->isOk()) {
+			delete doc;
+			return NULL;
+		}
+
+		if (pdfDocCount == PDF_DOCS_KEPT) {
+			delete pdfDocs[PDF_DOCS_KEPT - 1].hints;
+			delete pdfDocs[PDF_DOCS_KEPT - 1].doc;
+			free(pdfDocs[PDF_DOCS_KEPT - 1].filename);
+			pdfDocCount--;
+		}
+		i = pdfDocCount++;
+		pdfDocs[i].filename = xstrdup(filename);
+		pdfDocs[i].size = st.st_size;
+		pdfDocs[i].mtime = st.st_mtime;
+		pdfDocs[i].doc = doc;
+		pdfDocs[i].hints = NULL;
+		pdfDocs[i].hintsRead = false;
+	}
+
+	if (i > 0) {
+		/* move it to the front */
+		char*	filename = pdfDocs[i].filename;
+		PDFDoc*	doc = pdfDocs[i].doc;
+		Hints*	hints = pdfDocs[i].hints;
+		bool	hintsRead = pdfDocs[i].hintsRead;
+		for (; i > 0; i--)
+			pdfDocs[i] = pdfDocs[i - 1];
+		pdfDocs[0].filename = filename;
+		pdfDocs[0].size = st.st_size;
+		pdfDocs[0].mtime = st.st_mtime;
+		pdfDocs[0].doc = doc;
+		pdfDocs[0].hints = hints;
+		pdfDocs[0].hintsRead = hintsRead;
 	}
 
-	/* if the doc got created, it now owns name, so we mustn't delete it! */
+	return pdfDocs[0].doc;
+}
+
+/* Catalog::getPage builds a Page for every page up to the one asked for,
+   so instead we find the page's own dictionary and the Pages nodes above
+   it, and merge their attributes as the Catalog would. For a linearized
+   file the hint tables give the page, and we climb its /Parent chain;
+   otherwise we descend from the root, skipping each subtree that /Count
+   says holds only earlier pages; at each level the counts of the kids
+   have to add up to the /Count of their parent. Returns NULL if the tree
+   isn't shaped as expected, leaving it to the Catalog to make what it can
+   of the file. */
+#define PDF_TREE_DEPTH 64
 
-	if (!doc->isOk()) {
-		delete doc;
+/* the number of pages under the kid /kid/ of a Pages node, or -1 */
+static int
+pdf_kid_count(Object* kid)
+{
+	Object	obj;
+	int		count;
+
+	if (!kid->isDict())
 		return -1;
+	if (kid->isDict("Page") || !kid->getDict()->hasKey("Kids"))
+		return 1;
+	count = kid->dictLookup("Count", &obj)->isNum() ? (int)obj.getNum() : -1;
+	obj.free();
+	return count;
+}
+
+static PageAttrs*
+pdf_page_attrs(PDFDoc* doc, Hints* hints, int page_num)
+{
+	XRef*		xref = doc->getXRef();
+	Object		path[PDF_TREE_DEPTH];
+	int			depth = 0;
+	bool		found = false;
+	Object		catDict, rootRef, node;
+	PageAttrs*	attrs = NULL;
+	int			i;
+
+	xref->getCatalog(&catDict);
+	if (catDict.isDict())
+		catDict.dictLookupNF("Pages", &rootRef);
+	catDict.free();
+	if (!rootRef.isRef()) {
+		rootRef.free();
+		return NULL;
 	}
 
-	int			pages = doc->getNumPages();
-	if (page_num > pages)
-		page_num = pages;
-	if (page_num < 0)
-		page_num = pages + 1 + page_num;
-	if (page_num < 1)
-		page_num = 1;
+	if (hints != NULL && hints->getPageObjectNum(page_num) > 0
+			&& hints->getPageObjectNum(page_num) < xref->getNumObjects()) {
+		Ref		ref;
+		ref.num = hints->getPageObjectNum(page_num);
+		ref.gen = xref->getEntry(ref.num)->gen;
+		xref->fetch(ref.num, ref.gen, &node);
+		if (node.isDict("Page")) {
+			while (node.isDict() && depth < PDF_TREE_DEPTH) {
+				Object	parent;
+				path[depth++] = node;
+				node.initNull();
+				if (ref.num == rootRef.getRefNum() && ref.gen == rootRef.getRefGen()) {
+					found = depth > 1;
+					break;
+				}
+				if (path[depth - 1].dictLookupNF("Parent", &parent)->isRef()) {
+					ref = parent.getRef();
+					xref->fetch(ref.num, ref.gen, &node);
+				}
+				parent.free();
+			}
+			node.free();
+			if (found) {
+				for (i = 0; i < depth / 2; i++) {
+					Object	t = path[i];
+					path[i] = path[depth - 1 - i];
+					path[depth - 1 - i] = t;
+				}
+			} else {
+				while (depth > 0)
+					path[--depth].free();
+			}
+		}
+		node.free();
+	}
+
+	if (!found) {
+		int		skip = page_num - 1;
+		rootRef.fetch(xref, &node);
+		while (node.isDict() && depth < PDF_TREE_DEPTH) {
+			Dict*	dict = node.getDict();
+			Object	kids, obj;
+			int		total, sum = 0;
+			path[depth++] = node;
+			node.initNull();
+			if (depth > 1 && (path[depth - 1].isDict("Page") || !dict->hasKey("Kids"))) {
+				found = true;
+				break;
+			}
+			total = dict->lookup("Count", &obj)->isNum() ? (int)obj.getNum() : -1;
+			obj.free();
+			if (dict->lookup("Kids", &kids)->isArray()) {
+				for (i = 0; i < kids.arrayGetLength() && sum >= 0; i++) {
+					Object	kid;
+					int		count = pdf_kid_count(kids.arrayGet(i, &kid));
+					sum = count < 0 ? -1 : sum + count;
+					if (count >= 0 && node.isNull() && skip < count)
+						node = kid;
+					else {
+						if (count >= 0 && node.isNull())
+							skip -= count;
+						kid.free();
+					}
+				}
+			}
+			kids.free();
+			if (sum != total)
+				node.free();
+		}
+		node.free();
+	}
+
+	if (found) {
+		for (i = 0; i < depth; i++) {
+			PageAttrs*	parent = attrs;
+			attrs = new PageAttrs(parent, path[i].getDict());
+			delete parent;
+		}
+		attrs->clipBoxes();
+	}
 
-	Page*		page = doc->getCatalog()->getPage(page_num);
+	for (i = 0; i < depth; i++)
+		path[i].free();
+	rootRef.free();
+
+	return attrs;
+}
 
-	PDFRectangle*	r;
+template <class T>
+static PDFRectangle*
+pdf_box_rect(T* page, int pdf_box)
+{
 	switch (pdf_box) {
 		default:
 		case pdfbox_crop:
-			r = page->getCropBox();
-			break;
+			return page->getCropBox();
 		case pdfbox_media:
-			r = page->getMediaBox();
-			break;
+			return page->getMediaBox();
 		case pdfbox_bleed:
-			r = page->getBleedBox();
-			break;
+			return page->getBleedBox();
 		case pdfbox_trim:
-			r = page->getTrimBox();
-			break;
+			return page->getTrimBox();
 		case pdfbox_art:
-			r = page->getArtBox();
-			break;
+			return page->getArtBox();
+	}
+}
+
+int
+pdf_get_rect(char* filename, int page_num, int pdf_box, realrect* box)
+	/* return the box converted to TeX points */
+{
+	PDFDoc*		doc = pdf_open_doc(filename);
+
+	if (!doc)
+		return -1;
+
+	int			pages = doc->getNumPages();
+	if (page_num > pages)
+		page_num = pages;
+	if (page_num < 0)
+		page_num = pages + 1 + page_num;
+	if (page_num < 1)
+		page_num = 1;
+
+	/* pdf_open_doc has put the document at the front of pdfDocs */
+	if (!pdfDocs[0].hintsRead) {
+		pdfDocs[0].hintsRead = true;
+		if (doc->isLinearized() && !doc->getXRef()->isEncrypted())
+			pdfDocs[0].hints = new Hints(doc->getBaseStream(), doc->getLinearization(),
+										 doc->getXRef(), NULL);
 	}
 
-	box->x  = 72.27 / 72 * my_fmin(r->x1, r->x2);
-	box->y  = 72.27 / 72 * my_fmin(r->y1, r->y2);
-	box->wd = 72.27 / 72 * fabs(r->x2 - r->x1);
-	box->ht = 72.27 / 72 * fabs(r->y2 - r->y1);
+	PDFRectangle	r;
+	PageAttrs*	attrs = pdf_page_attrs(doc, pdfDocs[0].hints, page_num);
+	if (attrs != NULL) {
+		r = *pdf_box_rect(attrs, pdf_box);
+		delete attrs;
+	} else {
+		Page*	page = doc->getCatalog()->getPage(page_num);
+		if (page == NULL)
+			return -1;
+		r = *pdf_box_rect(page, pdf_box);
+	}
 
-	delete doc;
+	box->x  = 72.27 / 72 * my_fmin(r.x1, r.x2);
+	box->y  = 72.27 / 72 * my_fmin(r.y1, r.y2);
+	box->wd = 72.27 / 72 * fabs(r.x2 - r.x1);
+	box->ht = 72.27 / 72 * fabs(r.y2 - r.y1);
 
 	return 0;
 }
@@ -111,21 +342,10 @@ pdf_get_rect(char* filename, int page_num, int pdf_box, realrect* box)
 int
 pdf_count_pages(char* filename)
 {
-	int			pages = 0;
-	GooString*	name = new GooString(filename);
-	PDFDoc*		doc = new PDFDoc(name);
+	PDFDoc*		doc = pdf_open_doc(filename);
 
-	if (!doc) {
-		delete name;
+	if (!doc)
 		return 0;
-	}
-
-	/* if the doc got created, it now owns name, so we mustn't delete it! */
-
-	if (doc->isOk())
-		pages = doc->getNumPages();
-
-	delete doc;
 
-	return pages;
+	return doc->getNumPages();
 }
@@ -45,11 +45,17 @@ authorization from the copyright holders.
 
 /* p is native_word node; g is XeTeX_use_glyph_metrics flag */
 #define setnativemetrics(p,g)                   measure_native_node(&(mem[p]), g)
+#define setnativefragmentmetrics(p,q,s,l,g)     measure_native_fragment(&(mem[p]), &(mem[q]), s, l, g)
 
 #define setnativeglyphmetrics(p,g)              measure_native_glyph(&(mem[p]), g)
 
 #define setjustifiednativeglyphs(p)             store_justified_native_glyphs(&(mem[p]))
 
+#define beginmergednativeglyphs(p)              begin_merged_native_glyphs(&(mem[p]))
+#define appendmergednativeglyphs(p)             append_merged_native_glyphs(&(mem[p]))
+#define appendmergednativespace                 append_merged_native_space
+#define storemergednativeglyphs(p)              store_merged_native_glyphs(&(mem[p]))
+
 #define getnativeitaliccorrection(p)            get_native_italic_correction(&(mem[p]))
 #define getnativeglyphitaliccorrection(p)       get_native_glyph_italic_correction(&(mem[p]))
 
@@ -60,6 +66,8 @@ authorization from the copyright holders.
 
 #define getcpcode       get_cp_code
 #define setcpcode       set_cp_code
+#define dumpcpcodes     dump_cp_codes
+#define undumpcpcodes   undump_cp_codes
 #define getnativewordcp(p,s)                    get_native_word_cp(&(mem[p]), s)
 
 #define pic_node_size                           9
@@ -71,6 +79,9 @@ authorization from the copyright holders.
 #define picpathbyte(p,i)                        ((unsigned char*)&(mem[p+pic_node_size]))[i]
 
 #define dviopenout(f)                           open_dvi_output(&(f))
+#define xdvindexfont(f,u,l)                     xdv_index_font(f, u, l)
+#define xdvindexpage(n,b,e)                     xdv_index_page(n, b, e)
+#define xdvindexpic(p,l)                        xdv_index_pic((const char*)&(mem[p+pic_node_size]), l)
 
 #define nullptr                                 (NULL)
 #define glyphinfobyte(p,k)                      ((unsigned char*)p)[k]